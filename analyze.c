@@ -0,0 +1,100 @@
+#include "analyze.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nmr.h"
+#include "script.h"
+#include "species.h"
+
+#define LINE_LEN 256
+
+// Extra cost of a step, in plain steps (measured on 200000-step runs)
+#define SPECIES_COST 0.25 // Each species after the first (model and output column)
+#define UPDATE_COST 0.25 // Re-anchoring the model, per species
+#define FM_POINT_COST 0.0025 // Re-anchoring with modulation, per species and point
+#define THERMAL_COST 0.2 // Thermal model step
+#define SWEEP_POINT_COST 0.0075 // Q-meter sweep, per point
+
+// What the run has switched on, as far as the cost of a step goes
+struct run_load {
+    int n_species;
+    bool beam, thermal;
+    int fm_points; // 0 == no modulation
+    int sweep_points; // 0 == Q-meter off
+};
+
+static double step_cost(const struct run_load *load) {
+    double cost = 1.0 + SPECIES_COST * (load->n_species - 1);
+    if (load->beam || load->thermal) {
+        cost += load->n_species * (load->fm_points ? FM_POINT_COST * load->fm_points : UPDATE_COST);
+    }
+    if (load->thermal) cost += THERMAL_COST;
+    cost += SWEEP_POINT_COST * load->sweep_points;
+    return cost;
+}
+
+// Steps taken while running from *time up to until (the loop in run_until)
+static unsigned long run_steps(double *time, double until, double step) {
+    if (until < *time) return 0;
+    unsigned long n = (unsigned long)floor((until - *time) / step) + 1;
+    *time += n * step;
+    return n;
+}
+
+int analyze_run(const char *path, double step, struct run_plan *plan) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 1;
+    memset(plan, 0, sizeof(*plan));
+    plan->n_species = 1;
+
+    double time = 0.0;
+    bool in_init = false;
+    struct run_load load = {1, false, false, 0, 0};
+    char line[LINE_LEN];
+    while (fgets(line, LINE_LEN, f)) {
+        if (!script_parse(line)) continue;
+        double value;
+        if (script_cmdequ("serial")) {
+            plan->serial = !strcmp(script_getarg(0), "on");
+        } else if (script_cmdequ("init")) {
+            in_init = true;
+        } else if (script_cmdequ("done")) {
+            in_init = false;
+        } else if (script_cmdequ("spec")) {
+            if (plan->n_species < MAX_SPECIES) plan->n_species++;
+            load.n_species = plan->n_species;
+        } else if (in_init) {
+            // The init block sets up the history, it doesn't run
+            continue;
+        } else if (script_cmdequ("beam")) {
+            load.beam = !strcmp(script_getarg(0), "on");
+        } else if (script_cmdequ("thrm")) {
+            load.thermal = !strcmp(script_getarg(0), "on");
+        } else if (script_cmdequ("qmtr")) {
+            int points = atoi(script_getarg(1));
+            load.sweep_points = strcmp(script_getarg(0), "on") ? 0 : points > 0 ? points : NMR_DEFAULT_POINTS;
+        } else if (script_cmdequ("fmod")) {
+            int points = atoi(script_getarg(2));
+            load.fm_points = atof(script_getarg(0)) <= 0.0 ? 0 : points > 0 ? points : FM_DEFAULT_POINTS;
+        } else if (script_cmdequ("time") && sscanf(script_getarg(0), "%6lf", &value) == 1) {
+            unsigned long n = run_steps(&time, value, step);
+            plan->steps += n;
+            plan->work += n * step_cost(&load);
+        }
+    }
+    fclose(f);
+    plan->end_time = time;
+    if (plan->serial) {
+        return 0;
+    }
+    plan->rows = plan->steps;
+
+    // A row as output_data writes it, with the widest time and percentages
+    int width = snprintf(NULL, 0, "%6lf %6lf %6lf %6lf %6lf %6lf N/A   \n", time, 140.0, -100.0, 100.0, 0.0, -1.0);
+    width += (plan->n_species - 1) * snprintf(NULL, 0, " %6lf", -100.0);
+    plan->bytes = (unsigned long long)plan->rows * width;
+    return 0;
+}
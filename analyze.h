@@ -0,0 +1,31 @@
+// analyze.h --- Static analysis of a run file (before running it)
+//
+// Walks the run file's commands without simulating anything: adds up how
+// long the run lasts ('time' outside the init block; 'trip' and 'annl'
+// don't run a simulation yet, so they add nothing) and, at one output row
+// per time step, how many rows and about how many bytes the output will
+// take. Serial runs write a row whenever the box sends one, so their size
+// is unknown.
+// It also estimates the work of the run, in plain steps (one species and
+// nothing else switched on): each step costs more with every extra species,
+// the beam or thermal model (the model is re-anchored every step, once per
+// modulation point when 'fmod' is on) and the Q-meter sweep. Multiplied by
+// the measured time of a plain step, that predicts how long the run takes.
+#ifndef _ANALYZE_H
+#define _ANALYZE_H
+
+#include <stdbool.h>
+
+struct run_plan {
+    bool serial; // Rows come from the box (rows and bytes are 0)
+    double end_time; // Simulated seconds at the end of the run
+    int n_species; // Species in the output (1 plus 'spec' lines)
+    unsigned long steps; // Time steps simulated
+    double work; // Estimated work, in plain steps
+    unsigned long rows; // Output rows (steps, unless serial)
+    unsigned long long bytes; // Approximate size of the output
+};
+
+int analyze_run(const char *path, double step, struct run_plan *plan); // returns 0 on success (1 if the file can't be read)
+
+#endif
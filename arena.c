@@ -0,0 +1,86 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// All allocations are aligned to this (enough for any scalar type)
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size; // Usable bytes in data
+    size_t used; // Bytes handed out so far
+    // Data follows the header
+};
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static char *block_data(struct arena_block *b) {
+    return (char*)b + align_up(sizeof(struct arena_block));
+}
+
+static struct arena_block *new_block(struct arena *a, size_t size) {
+    struct arena_block *b = malloc(align_up(sizeof(struct arena_block)) + size);
+    if (!b) return NULL;
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+    a->n_mallocs++;
+    return b;
+}
+
+int arena_init(struct arena *a, size_t block_size) {
+    a->block_size = align_up(block_size);
+    a->n_allocs = 0;
+    a->n_mallocs = 0;
+    a->first = a->curr = new_block(a, a->block_size);
+    return !a->first;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size = align_up(size);
+    // Look for room in the current block, then in any blocks kept from
+    // a previous run, before asking the system for more memory
+    while (a->curr->used + size > a->curr->size) {
+        if (!a->curr->next) {
+            size_t want = size > a->block_size ? size : a->block_size;
+            struct arena_block *b = new_block(a, want);
+            if (!b) return NULL;
+            a->curr->next = b;
+        }
+        a->curr = a->curr->next;
+    }
+    void *ptr = block_data(a->curr) + a->curr->used;
+    a->curr->used += size;
+    a->n_allocs++;
+    return ptr;
+}
+
+char *arena_strdup(struct arena *a, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(a, len);
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+void arena_reset(struct arena *a) {
+    for (struct arena_block *b = a->first; b; b = b->next) {
+        b->used = 0;
+    }
+    a->curr = a->first;
+    a->n_allocs = 0;
+}
+
+void arena_free(struct arena *a) {
+    struct arena_block *b = a->first;
+    while (b) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->first = a->curr = NULL;
+}
@@ -0,0 +1,23 @@
+// arena.h --- Per-run memory arena (everything a run allocates is freed in one shot)
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+struct arena_block; // Opaque, see arena.c
+
+struct arena {
+    struct arena_block *first; // First block (kept across resets)
+    struct arena_block *curr; // Block currently being allocated from
+    size_t block_size; // Minimum size of each new block
+    size_t n_allocs; // Number of allocations served since the last reset
+    size_t n_mallocs; // Number of times the arena itself called malloc (never reset)
+};
+
+int arena_init(struct arena *a, size_t block_size); // returns 0 on success
+void *arena_alloc(struct arena *a, size_t size); // returns NULL if out of memory
+char *arena_strdup(struct arena *a, const char *str); // copies str into the arena
+void arena_reset(struct arena *a); // releases all allocations, keeping the memory for the next run
+void arena_free(struct arena *a); // gives all memory back to the system
+
+#endif
@@ -0,0 +1,226 @@
+#include "arrow.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Values from Arrow's Schema.fbs and Message.fbs
+#define METADATA_V5 4
+#define HEADER_SCHEMA 1
+#define HEADER_RECORD_BATCH 3
+#define TYPE_FLOATING_POINT 3
+#define PRECISION_DOUBLE 2
+
+#define CONTINUATION 0xFFFFFFFF
+#define BODY_ALIGN 64
+#define FB_LEN 8192 // Enough metadata for ARROW_MAX_COLS columns
+#define MAX_FIELDS 8 // Fields of the largest table written here
+
+// Flatbuffer, laid out front to back: every table, vector or string comes
+// after whatever refers to it (offsets are unsigned and point forward)
+struct fb {
+    unsigned char buf[FB_LEN];
+    size_t len;
+};
+
+static size_t align_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+static void fb_pad(struct fb *b, size_t align) {
+    size_t end = align_up(b->len, align);
+    memset(b->buf + b->len, 0, end - b->len);
+    b->len = end;
+}
+
+// Little-endian, like every supported platform
+static size_t fb_put(struct fb *b, const void *data, size_t n) {
+    size_t at = b->len;
+    memcpy(b->buf + at, data, n);
+    b->len += n;
+    return at;
+}
+
+static void fb_put_u32(struct fb *b, uint32_t value) {
+    fb_put(b, &value, 4);
+}
+
+// Points the offset field at `at` to target
+static void fb_patch(struct fb *b, size_t at, size_t target) {
+    uint32_t offset = target - at;
+    memcpy(b->buf + at, &offset, 4);
+}
+
+// Writes a vtable and its table; sizes[i] == 0 leaves field i out. Offset
+// fields are written as 0 (fb_patch them once their target is written).
+// Returns the table's position, with each field's position in pos.
+static size_t fb_table(struct fb *b, int n, const int *sizes, const uint64_t *values, size_t *pos) {
+    fb_pad(b, 2);
+    size_t vtable = b->len;
+    size_t start = align_up(vtable + 4 + 2*n, 4);
+    uint16_t vt[2 + MAX_FIELDS];
+    size_t p = start + 4;
+    for (int i = 0; i < n; i++) {
+        vt[2 + i] = 0;
+        if (!sizes[i]) continue;
+        p = align_up(p, sizes[i]);
+        pos[i] = p;
+        vt[2 + i] = p - start;
+        p += sizes[i];
+    }
+    vt[0] = 4 + 2*n;
+    vt[1] = p - start;
+    fb_put(b, vt, 4 + 2*n);
+    fb_pad(b, 4);
+    int32_t soffset = start - vtable;
+    fb_put(b, &soffset, 4);
+    for (int i = 0; i < n; i++) {
+        if (!sizes[i]) continue;
+        fb_pad(b, sizes[i]);
+        fb_put(b, &values[i], sizes[i]);
+    }
+    return start;
+}
+
+// Writes a vector's length so that its elements start aligned, returns the length's position
+static size_t fb_vector(struct fb *b, uint32_t n, size_t align) {
+    fb_pad(b, 4);
+    while ((b->len + 4) % align) {
+        fb_put_u32(b, 0);
+    }
+    size_t at = b->len;
+    fb_put_u32(b, n);
+    return at;
+}
+
+static size_t fb_string(struct fb *b, const char *s) {
+    uint32_t len = strlen(s);
+    size_t at = fb_vector(b, len, 4);
+    fb_put(b, s, len + 1);
+    return at;
+}
+
+// Message table with an empty header, returns the position of the header field
+static size_t fb_message(struct fb *b, int header_type, int64_t body_len) {
+    b->len = 0;
+    fb_put_u32(b, 0); // Root offset
+    int sizes[4] = {2, 1, 4, 8};
+    uint64_t values[4] = {METADATA_V5, header_type, 0, body_len};
+    size_t pos[4];
+    size_t message = fb_table(b, 4, sizes, values, pos);
+    fb_patch(b, 0, message);
+    return pos[2];
+}
+
+// Writes the encapsulated message: marker, metadata length, metadata (padded to 8)
+static int write_message(FILE *f, struct fb *b) {
+    fb_pad(b, 8);
+    uint32_t prefix[2] = {CONTINUATION, b->len};
+    return fwrite(prefix, sizeof(prefix), 1, f) != 1 || fwrite(b->buf, 1, b->len, f) != b->len;
+}
+
+static int write_schema(FILE *f, int n_cols, const char (*names)[ARROW_NAME_LEN]) {
+    static struct fb b;
+    size_t header = fb_message(&b, HEADER_SCHEMA, 0);
+
+    // Schema: endianness (little), fields
+    int schema_sizes[2] = {2, 4};
+    uint64_t schema_values[2] = {0, 0};
+    size_t schema_pos[2];
+    fb_patch(&b, header, fb_table(&b, 2, schema_sizes, schema_values, schema_pos));
+    size_t fields = fb_vector(&b, n_cols, 4);
+    for (int c = 0; c < n_cols; c++) {
+        fb_put_u32(&b, 0);
+    }
+    fb_patch(&b, schema_pos[1], fields);
+
+    for (int c = 0; c < n_cols; c++) {
+        // Field: name, nullable, type_type, type, dictionary (none), children
+        int sizes[6] = {4, 1, 1, 4, 0, 4};
+        uint64_t values[6] = {0, 0, TYPE_FLOATING_POINT, 0, 0, 0};
+        size_t pos[6];
+        fb_patch(&b, fields + 4 + 4*c, fb_table(&b, 6, sizes, values, pos));
+        int fp_size = 2;
+        uint64_t fp_value = PRECISION_DOUBLE;
+        size_t fp_pos;
+        fb_patch(&b, pos[3], fb_table(&b, 1, &fp_size, &fp_value, &fp_pos));
+        char name[ARROW_NAME_LEN];
+        snprintf(name, ARROW_NAME_LEN, "%s", names[c]);
+        fb_patch(&b, pos[0], fb_string(&b, name));
+        fb_patch(&b, pos[5], fb_vector(&b, 0, 4));
+    }
+    return write_message(f, &b);
+}
+
+static int write_batch(struct arrow_writer *w) {
+    if (!w->n_rows) return 0;
+    size_t col_len = (size_t)w->n_rows * sizeof(double);
+    size_t padded = align_up(col_len, BODY_ALIGN);
+
+    static struct fb b;
+    size_t header = fb_message(&b, HEADER_RECORD_BATCH, (int64_t)padded * w->n_cols);
+    // RecordBatch: length, nodes, buffers
+    int sizes[3] = {8, 4, 4};
+    uint64_t values[3] = {w->n_rows, 0, 0};
+    size_t pos[3];
+    fb_patch(&b, header, fb_table(&b, 3, sizes, values, pos));
+
+    // One node per column (length, null count), two buffers (no validity bitmap, the values)
+    fb_patch(&b, pos[1], fb_vector(&b, w->n_cols, 8));
+    for (int c = 0; c < w->n_cols; c++) {
+        int64_t node[2] = {w->n_rows, 0};
+        fb_put(&b, node, sizeof(node));
+    }
+    fb_patch(&b, pos[2], fb_vector(&b, 2 * w->n_cols, 8));
+    for (int c = 0; c < w->n_cols; c++) {
+        int64_t buffers[4] = {(int64_t)(padded * c), 0, (int64_t)(padded * c), (int64_t)col_len};
+        fb_put(&b, buffers, sizeof(buffers));
+    }
+    if (write_message(w->f, &b)) return 1;
+
+    static const char zeros[BODY_ALIGN];
+    for (int c = 0; c < w->n_cols; c++) {
+        if (fwrite(w->cols + (size_t)c * ARROW_BATCH_ROWS, 1, col_len, w->f) != col_len
+            || fwrite(zeros, 1, padded - col_len, w->f) != padded - col_len) {
+            return 1;
+        }
+    }
+    w->total_rows += w->n_rows;
+    w->n_rows = 0;
+    return 0;
+}
+
+int arrow_open(struct arrow_writer *w, const char *path, int n_cols, const char (*names)[ARROW_NAME_LEN]) {
+    memset(w, 0, sizeof(*w));
+    if (n_cols < 1 || n_cols > ARROW_MAX_COLS) return 1;
+    w->n_cols = n_cols;
+    w->cols = malloc((size_t)n_cols * ARROW_BATCH_ROWS * sizeof(double));
+    if (!w->cols) return 1;
+    w->f = fopen(path, "wb");
+    if (!w->f || write_schema(w->f, n_cols, names)) {
+        if (w->f) fclose(w->f);
+        free(w->cols);
+        return 1;
+    }
+    return 0;
+}
+
+int arrow_add(struct arrow_writer *w, const double *row) {
+    for (int c = 0; c < w->n_cols; c++) {
+        w->cols[(size_t)c * ARROW_BATCH_ROWS + w->n_rows] = row[c];
+    }
+    if (++w->n_rows == ARROW_BATCH_ROWS) {
+        return write_batch(w);
+    }
+    return 0;
+}
+
+int arrow_close(struct arrow_writer *w) {
+    int failed = write_batch(w);
+    uint32_t end[2] = {CONTINUATION, 0};
+    failed |= fwrite(end, sizeof(end), 1, w->f) != 1;
+    failed |= fclose(w->f) != 0;
+    free(w->cols);
+    w->f = NULL;
+    return failed;
+}
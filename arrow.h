@@ -0,0 +1,33 @@
+// arrow.h --- Output as an Apache Arrow IPC stream
+//
+// The columns are written as Arrow record batches of float64, so analysis
+// tools (pyarrow, polars, DuckDB, ...) can memory-map the file and use the
+// numbers as they are, without parsing any text. The stream is:
+//   a Schema message (one non-null float64 field per column),
+//   a RecordBatch message every ARROW_BATCH_ROWS rows (and one for the rest),
+//   the end-of-stream marker (0xFFFFFFFF, 0).
+// Every message is the continuation marker, the length of its metadata,
+// the metadata (a flatbuffer, built by hand here so no Arrow or flatbuffers
+// library is needed) and the body: each column's values, 64-byte aligned.
+#ifndef _ARROW_H
+#define _ARROW_H
+
+#include <stdio.h>
+
+#define ARROW_MAX_COLS 16
+#define ARROW_NAME_LEN 16 // Length of a column name (including the terminator)
+#define ARROW_BATCH_ROWS 65536 // Rows per record batch
+
+struct arrow_writer {
+    FILE *f;
+    int n_cols;
+    int n_rows; // Rows in the current batch
+    double *cols; // n_cols columns of ARROW_BATCH_ROWS
+    unsigned long total_rows;
+};
+
+int arrow_open(struct arrow_writer *w, const char *path, int n_cols, const char (*names)[ARROW_NAME_LEN]); // writes the schema, returns 0 on success
+int arrow_add(struct arrow_writer *w, const double *row); // appends a row of n_cols values, returns 0 on success
+int arrow_close(struct arrow_writer *w); // writes the last batch and ends the stream, returns 0 on success
+
+#endif
@@ -0,0 +1,292 @@
+#define _GNU_SOURCE // For sched_setaffinity
+
+#include "batch.h"
+#include "log.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__) || defined(__FreeBSD__)
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_NUMA_NODES 64
+
+static int n_numa_nodes(); // Number of NUMA nodes (1 if unknown)
+static void pin_to_node(int node); // Restricts the calling process to the CPUs of a node
+
+static double predict(const struct batch_estimate *e, double step_time) {
+    return e->work * step_time + e->paced;
+}
+
+// Next job to start (-1 if none is left): the longest pending one, or the
+// first if there are no estimates
+static int next_job(int n_jobs, const bool *pending, const struct batch_estimate *estimates, double step_time) {
+    int best = -1;
+    for (int j = 0; j < n_jobs; j++) {
+        if (!pending[j]) continue;
+        if (!estimates) return j;
+        if (best < 0 || predict(&estimates[j], step_time) > predict(&estimates[best], step_time)) {
+            best = j;
+        }
+    }
+    return best;
+}
+
+// Makespan of the pending jobs, started longest first on n_workers
+static double predict_makespan(int n_jobs, const bool *pending, int n_workers,
+                               const struct batch_estimate *estimates, double step_time) {
+    bool *left = malloc(n_jobs * sizeof(bool));
+    double *busy = calloc(n_workers, sizeof(double)); // When each worker is free again
+    double makespan = 0.0;
+    if (left && busy) {
+        memcpy(left, pending, n_jobs * sizeof(bool));
+        int j;
+        while ((j = next_job(n_jobs, left, estimates, step_time)) >= 0) {
+            left[j] = false;
+            int w = 0;
+            for (int i = 1; i < n_workers; i++) {
+                if (busy[i] < busy[w]) w = i;
+            }
+            busy[w] += predict(&estimates[j], step_time);
+            if (busy[w] > makespan) makespan = busy[w];
+        }
+    }
+    free(left);
+    free(busy);
+    return makespan;
+}
+
+struct batch_result *batch_run(int n_jobs, int n_workers, bool numa, const struct batch_estimate *estimates,
+                               batch_job_fn job, struct journal *journal) {
+    // The table is shared with the workers, so results survive the worker exiting
+    size_t table_size = n_jobs * sizeof(struct batch_result);
+    struct batch_result *results = mmap(NULL, table_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("Could not create batch results table");
+        return NULL;
+    }
+    memset(results, 0, table_size);
+    for (int j = 0; journal && j < n_jobs; j++) {
+        if (journal->done[j]) {
+            results[j].status = BATCH_SKIPPED;
+            results[j].offset = journal->offset[j];
+        }
+    }
+
+    int n_nodes = numa ? n_numa_nodes() : 1;
+    n_workers = batch_workers(n_jobs, n_workers, numa);
+    printf("Running %d jobs on %d workers", n_jobs, n_workers);
+    if (numa) printf(" across %d NUMA nodes", n_nodes);
+    putchar('\n');
+
+    pid_t *pids = calloc(n_workers, sizeof(pid_t)); // Worker pid per slot (0 == free)
+    int *slot_job = calloc(n_workers, sizeof(int)); // Job running in each slot
+    struct timespec *start = calloc(n_workers, sizeof(struct timespec));
+    bool *pending = malloc(n_jobs * sizeof(bool)); // Not started yet
+    if (!pids || !slot_job || !start || !pending) {
+        puts("Could not allocate worker table");
+        free(pids); free(slot_job); free(start); free(pending);
+        munmap(results, table_size);
+        return NULL;
+    }
+    int n_pending = 0;
+    for (int j = 0; j < n_jobs; j++) {
+        pending[j] = results[j].status != BATCH_SKIPPED;
+        n_pending += pending[j];
+    }
+
+    // Step time, calibrated from the work and (busy) time of finished jobs
+    double step_time = BATCH_STEP_TIME;
+    double timed_work = 0.0, timed_busy = 0.0;
+    double predicted = 0.0;
+    struct timespec batch_start;
+    clock_gettime(CLOCK_MONOTONIC, &batch_start);
+    if (estimates) {
+        predicted = predict_makespan(n_jobs, pending, n_workers, estimates, step_time);
+        printf("Starting the longest jobs first (about %6lf s in all)\n", predicted);
+    }
+    fflush(stdout); // Don't let the workers inherit buffered output
+
+    int running = 0;
+    while (n_pending > 0 || running > 0) {
+        // Fill every free slot
+        for (int slot = 0; slot < n_workers && n_pending > 0; slot++) {
+            if (pids[slot]) continue;
+
+            int j = next_job(n_jobs, pending, estimates, step_time);
+            pending[j] = false;
+            n_pending--;
+            results[j].status = BATCH_RUNNING;
+            results[j].node = numa ? slot % n_nodes : -1;
+            clock_gettime(CLOCK_MONOTONIC, &start[slot]);
+            fflush(NULL); // Don't let the worker inherit (and write again) any buffered output
+            pid_t pid = fork();
+            if (pid == 0) {
+                // Worker
+                if (numa) pin_to_node(results[j].node);
+                int code = job(j, &results[j]);
+                log_close(); // The worker never gets back to main, which would write out what it logged
+                fflush(NULL);
+                _exit(code & 0xFF);
+            } else if (pid < 0) {
+                perror("Could not start worker");
+                results[j].status = BATCH_FAILED;
+                results[j].code = -1;
+                continue;
+            }
+            if (journal) journal_start(journal, j);
+            pids[slot] = pid;
+            slot_job[slot] = j;
+            running++;
+        }
+
+        if (running == 0) continue;
+
+        // Wait for any worker and record how it ended
+        int wstatus;
+        pid_t pid = wait(&wstatus);
+        if (pid < 0) {
+            perror("wait");
+            break;
+        }
+        for (int slot = 0; slot < n_workers; slot++) {
+            if (pids[slot] != pid) continue;
+
+            struct batch_result *r = &results[slot_job[slot]];
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            r->wall_time = (end.tv_sec - start[slot].tv_sec) + 1e-9*(end.tv_nsec - start[slot].tv_nsec);
+            if (WIFSIGNALED(wstatus)) {
+                r->status = BATCH_CRASHED;
+                r->code = WTERMSIG(wstatus);
+                printf("Job %d crashed (signal %d), continuing\n", slot_job[slot], r->code);
+            } else {
+                r->code = WEXITSTATUS(wstatus);
+                r->status = r->code ? BATCH_FAILED : BATCH_DONE;
+                if (journal && r->status == BATCH_DONE) {
+                    journal_done(journal, slot_job[slot], r->offset);
+                }
+                const struct batch_estimate *e = estimates ? &estimates[slot_job[slot]] : NULL;
+                if (e && r->status == BATCH_DONE && e->work > 0) {
+                    timed_work += e->work;
+                    timed_busy += fmax(r->wall_time - e->paced, 0.0);
+                    step_time = timed_busy / timed_work;
+                }
+            }
+            pids[slot] = 0;
+            running--;
+            break;
+        }
+    }
+
+    if (estimates && timed_work > 0) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double took = (end.tv_sec - batch_start.tv_sec) + 1e-9*(end.tv_nsec - batch_start.tv_nsec);
+        printf("Took %6lf s (predicted %6lf s), %6lf steps per second\n", took, predicted, 1.0 / fmax(step_time, 1e-12));
+    }
+
+    free(pids);
+    free(slot_job);
+    free(start);
+    free(pending);
+    return results;
+}
+
+void batch_free(struct batch_result *results, int n_jobs) {
+    munmap(results, n_jobs * sizeof(struct batch_result));
+}
+
+static int n_numa_nodes() {
+    int n = 0;
+    char path[64];
+    for (; n < MAX_NUMA_NODES; n++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+        if (access(path, F_OK)) break;
+    }
+    return n ? n : 1;
+}
+
+static void pin_to_node(int node) {
+#ifdef __linux__
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (!f) return; // No NUMA information, leave the worker unpinned
+
+    // cpulist looks like "0-15,32-47"
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int lo, hi;
+    while (fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &hi) != 1) break;
+            c = fgetc(f);
+        }
+        for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &set);
+        }
+        if (c != ',') break;
+    }
+    fclose(f);
+
+    if (CPU_COUNT(&set) && sched_setaffinity(0, sizeof(set), &set)) {
+        perror("Could not pin worker to NUMA node");
+    }
+#else
+    (void)node;
+#endif
+}
+
+int batch_workers(int n_jobs, int n_workers, bool numa) {
+    if (n_workers <= 0) {
+        n_workers = numa ? n_numa_nodes() : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // More workers than jobs would only sit idle
+    if (n_workers > n_jobs) n_workers = n_jobs;
+    return n_workers > 0 ? n_workers : 1;
+}
+
+#else
+
+struct batch_result *batch_run(int n_jobs, int n_workers, bool numa, const struct batch_estimate *estimates,
+                               batch_job_fn job, struct journal *journal) {
+    (void)n_jobs; (void)n_workers; (void)numa; (void)estimates; (void)job; (void)journal;
+    puts("Batch mode is not supported on this platform");
+    return NULL;
+}
+
+void batch_free(struct batch_result *results, int n_jobs) {
+    (void)results; (void)n_jobs;
+}
+
+int batch_workers(int n_jobs, int n_workers, bool numa) {
+    (void)n_jobs; (void)n_workers; (void)numa;
+    return 1;
+}
+
+#endif
+
+const char *batch_status_name(int status) {
+    switch (status) {
+    case BATCH_PENDING: return "pending";
+    case BATCH_RUNNING: return "running";
+    case BATCH_DONE: return "done";
+    case BATCH_FAILED: return "failed";
+    case BATCH_CRASHED: return "crashed";
+    case BATCH_SKIPPED: return "skipped";
+    default: return "unknown";
+    }
+}
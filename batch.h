@@ -0,0 +1,55 @@
+// batch.h --- Runs many independent jobs in forked worker processes
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "journal.h"
+
+// Job states, as recorded in the shared results table
+#define BATCH_PENDING 0 // Not started yet
+#define BATCH_RUNNING 1 // Running in a worker
+#define BATCH_DONE 2 // Finished successfully
+#define BATCH_FAILED 3 // Worker returned an error
+#define BATCH_CRASHED 4 // Worker was killed by a signal (e.g. a segfault)
+#define BATCH_SKIPPED 5 // Already finished in an earlier session (according to the journal)
+
+// One row of the results table (lives in memory shared with the workers)
+struct batch_result {
+    int status; // One of the BATCH_* states (only written by the parent)
+    int code; // Exit code, or the signal number for crashed jobs
+    int node; // NUMA node the job ran on (-1 if not pinned)
+    double wall_time; // Real time taken by the job, in seconds
+    // Filled in by the job itself
+    double sim_time; // Final simulation time
+    double pol; // Final polarization
+    double dose; // Final dose
+    uint64_t offset; // Where the job stored its result (e.g. in an ensemble file)
+};
+
+// How long a job is expected to take
+struct batch_estimate {
+    double work; // Computing to do, in steps (timed as the batch goes)
+    double paced; // Seconds spent waiting on real time (e.g. a serial session's ticks)
+};
+
+#define BATCH_STEP_TIME 1e-6 // Seconds per step of work, until finished jobs have been timed
+
+typedef int (*batch_job_fn)(int job, struct batch_result *result); // returns 0 on success
+
+// Runs jobs 0 .. n_jobs-1, at most n_workers at a time (0 == one per CPU, or
+// one per NUMA node if numa is set). Each job runs in its own process, so a
+// crash only loses that job. If a journal is given, jobs it lists as finished
+// are skipped and every job's progress is recorded in it. With estimates,
+// the longest job left starts whenever a worker is free (so a long job
+// started last doesn't leave the others idle), and the time of a step is
+// calibrated from the jobs that finish; without, jobs start in order.
+// Returns the results table (NULL on failure).
+struct batch_result *batch_run(int n_jobs, int n_workers, bool numa, const struct batch_estimate *estimates,
+                               batch_job_fn job, struct journal *journal);
+int batch_workers(int n_jobs, int n_workers, bool numa); // how many workers batch_run actually runs at once
+void batch_free(struct batch_result *results, int n_jobs); // releases the results table
+const char *batch_status_name(int status); // human-readable job state
+
+#endif
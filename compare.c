@@ -0,0 +1,245 @@
+#define _GNU_SOURCE // For sysconf
+
+#include "compare.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ens.h"
+#include "parse.h"
+
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <pthread.h>
+#include <unistd.h>
+#define COMPARE_THREADS
+#define MAX_THREADS 64
+#endif
+
+// Columns of a .dat file
+#define DAT_TIME 0
+#define DAT_POL 2
+
+// Simulation rows, one at a time
+struct sim_reader {
+    int is_ens;
+    struct parse_stream dat;
+    struct ens_file ens;
+    int ens_time, ens_pol; // Column indices
+    size_t n_rows; // Rows every run has
+    size_t block_start, block_len, pos; // Block of rows in memory
+    double time[ENS_BLOCK_ROWS];
+    double pol[ENS_BLOCK_ROWS]; // Mean over the runs
+    double buf[ENS_BLOCK_ROWS];
+};
+
+static const char *SEGMENT_NAMES[N_SEGMENTS] = {"no beam", "beam", "trip", "anneal"};
+
+static int has_extension(const char *path, const char *ext) {
+    size_t len = strlen(path), ext_len = strlen(ext);
+    return len >= ext_len && !strcmp(path + len - ext_len, ext);
+}
+
+static int reader_open(struct sim_reader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->is_ens = has_extension(path, ".ens");
+    if (!r->is_ens) {
+        return parse_open(&r->dat, path);
+    }
+    if (ens_open(&r->ens, path)) return 1;
+    r->ens_time = r->ens_pol = -1;
+    for (int c = 0; c < r->ens.n_cols; c++) {
+        if (!strcmp(r->ens.names[c], "time")) r->ens_time = c;
+        if (!strcmp(r->ens.names[c], "pol")) r->ens_pol = c;
+    }
+    if (r->ens_time < 0 || r->ens_pol < 0 || r->ens.n_runs == 0) {
+        ens_close(&r->ens);
+        return 1;
+    }
+    r->n_rows = r->ens.runs[0].n_rows;
+    for (size_t i = 1; i < r->ens.n_runs; i++) {
+        if (r->ens.runs[i].n_rows < r->n_rows) r->n_rows = r->ens.runs[i].n_rows;
+    }
+    return 0;
+}
+
+// Reads the next row, returns 0 at the end
+static int reader_next(struct sim_reader *r, double *time, double *pol) {
+    if (!r->is_ens) {
+        if (!parse_next(&r->dat)) return 0;
+        *time = r->dat.num[DAT_TIME];
+        *pol = r->dat.num[DAT_POL];
+        return 1;
+    }
+    if (r->pos == r->block_len) {
+        // Next block, averaged over the runs
+        r->block_start += r->block_len;
+        r->block_len = r->n_rows - r->block_start;
+        if (r->block_len > ENS_BLOCK_ROWS) r->block_len = ENS_BLOCK_ROWS;
+        r->pos = 0;
+        if (r->block_len == 0) return 0;
+        if (ens_read_rows(&r->ens, 0, r->ens_time, r->block_start, r->block_len, r->time)) return 0;
+        memset(r->pol, 0, r->block_len * sizeof(double));
+        for (size_t i = 0; i < r->ens.n_runs; i++) {
+            if (ens_read_rows(&r->ens, i, r->ens_pol, r->block_start, r->block_len, r->buf)) return 0;
+            for (size_t k = 0; k < r->block_len; k++) {
+                r->pol[k] += r->buf[k];
+            }
+        }
+        for (size_t k = 0; k < r->block_len; k++) {
+            r->pol[k] /= r->ens.n_runs;
+        }
+    }
+    *time = r->time[r->pos];
+    *pol = r->pol[r->pos++];
+    return 1;
+}
+
+static void reader_close(struct sim_reader *r) {
+    if (r->is_ens) {
+        ens_close(&r->ens);
+    } else {
+        parse_close(&r->dat);
+    }
+}
+
+static void add_residual(struct residuals *r, double x) {
+    r->n++;
+    double delta = x - r->mean;
+    r->mean += delta / r->n;
+    r->m2 += delta * (x - r->mean);
+    if (fabs(x) > r->max_abs) r->max_abs = fabs(x);
+}
+
+// Segment started by an event (or the current one if the event is not a segment change)
+static int event_segment(const char *event, int seg) {
+    char lower[64];
+    size_t i = 0;
+    for (; event[i] && i < sizeof(lower) - 1; i++) {
+        lower[i] = tolower((unsigned char)event[i]);
+    }
+    lower[i] = '\0';
+    if (strstr(lower, "trip")) return SEG_TRIP;
+    if (strstr(lower, "anneal")) return SEG_ANNEAL;
+    if (strstr(lower, "beam on")) return SEG_BEAM;
+    if (strstr(lower, "beam off")) return SEG_NO_BEAM;
+    return seg;
+}
+
+static void compare_log(const char *sim_path, const char *log_path, double offset, struct comparison *c) {
+    memset(c, 0, sizeof(*c));
+    struct sim_reader *sim = malloc(sizeof(*sim));
+    struct parse_stream log;
+    if (!sim || reader_open(sim, sim_path)) {
+        free(sim);
+        c->failed = 1;
+        return;
+    }
+    if (parse_open(&log, log_path)) {
+        reader_close(sim);
+        free(sim);
+        c->failed = 1;
+        return;
+    }
+    int time_col = parse_column(&log.layout, "time");
+    int pol_col = parse_column(&log.layout, "pol");
+    int event_col = parse_column(&log.layout, "event");
+    if (time_col < 0 || pol_col < 0 || log.layout.type[time_col] != PARSE_NUMBER
+        || log.layout.type[pol_col] != PARSE_NUMBER) {
+        c->failed = 1;
+    }
+    if (event_col >= 0 && log.layout.type[event_col] != PARSE_TEXT) {
+        event_col = -1;
+    }
+
+    // Simulation rows t0 and t1 bracket the log time (the log is in time order)
+    double t0 = 0, p0 = 0, t1 = 0, p1 = 0;
+    int have = reader_next(sim, &t1, &p1);
+    t0 = t1;
+    p0 = p1;
+    int seg = SEG_NO_BEAM;
+    while (!c->failed && parse_next(&log)) {
+        if (event_col >= 0) {
+            seg = event_segment(log.text[event_col], seg);
+        }
+        double t = log.num[time_col] + offset;
+        double p = log.num[pol_col];
+        if (isnan(t) || isnan(p)) continue;
+        while (have && t1 < t) {
+            t0 = t1;
+            p0 = p1;
+            have = reader_next(sim, &t1, &p1);
+        }
+        if (t < t0 || t > t1) {
+            c->n_outside++;
+            continue;
+        }
+        double sim_pol = t1 > t0 ? p0 + (p1 - p0) * (t - t0) / (t1 - t0) : p1;
+        add_residual(&c->seg[seg], p - sim_pol);
+        add_residual(&c->all, p - sim_pol);
+    }
+    parse_close(&log);
+    reader_close(sim);
+    free(sim);
+}
+
+struct worker {
+    const char *sim_path;
+    char **log_paths;
+    int first, n_logs, stride;
+    double offset;
+    struct comparison *results;
+};
+
+static void *compare_worker(void *arg) {
+    struct worker *w = arg;
+    for (int i = w->first; i < w->n_logs; i += w->stride) {
+        compare_log(w->sim_path, w->log_paths[i], w->offset, &w->results[i]);
+    }
+    return NULL;
+}
+
+void compare_logs(const char *sim_path, int n_logs, char **log_paths, double offset, int n_threads,
+                  struct comparison *results) {
+    struct worker w = {sim_path, log_paths, 0, n_logs, 1, offset, results};
+#ifdef COMPARE_THREADS
+    if (n_threads <= 0) n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads > n_logs) n_threads = n_logs;
+    if (n_threads > MAX_THREADS) n_threads = MAX_THREADS;
+    if (n_threads > 1) {
+        // Thread k takes logs k, k + n_threads, ...
+        pthread_t threads[MAX_THREADS];
+        struct worker workers[MAX_THREADS];
+        int n_started = 0;
+        for (int k = 0; k < n_threads; k++) {
+            workers[k] = w;
+            workers[k].first = k;
+            workers[k].stride = n_threads;
+        }
+        for (int k = 1; k < n_threads && !pthread_create(&threads[k], NULL, compare_worker, &workers[k]); k++) {
+            n_started++;
+        }
+        compare_worker(&workers[0]);
+        for (int k = 1; k <= n_started; k++) {
+            pthread_join(threads[k], NULL);
+        }
+        for (int k = n_started + 1; k < n_threads; k++) {
+            compare_worker(&workers[k]); // Could not get a thread
+        }
+        return;
+    }
+#else
+    (void)n_threads;
+#endif
+    compare_worker(&w);
+}
+
+double residuals_rms(const struct residuals *r) {
+    // Mean square = variance + mean^2
+    return r->n ? sqrt(r->m2 / r->n + r->mean * r->mean) : NAN;
+}
+
+const char *compare_segment_name(int seg) {
+    return seg >= 0 && seg < N_SEGMENTS ? SEGMENT_NAMES[seg] : "unknown";
+}
@@ -0,0 +1,44 @@
+// compare.h --- Residuals of a simulation against a recorded experiment log
+//
+// The log is a CSV or whitespace-separated file whose header names a "time"
+// column (seconds from the start of the run) and a "pol" column (in %). An
+// optional "event" column splits the log into segments: "beam on", "beam off",
+// "trip" and "anneal" each start a segment of that kind, which lasts until the
+// next event. The simulation is a .dat file or an ensemble file (compared by
+// its mean over all runs). Both are streamed, so any length of log fits in a
+// fixed amount of memory.
+#ifndef _COMPARE_H
+#define _COMPARE_H
+
+#include <stddef.h>
+
+// Segments
+#define SEG_NO_BEAM 0
+#define SEG_BEAM 1
+#define SEG_TRIP 2
+#define SEG_ANNEAL 3
+#define N_SEGMENTS 4
+
+// Running statistics of log - simulation (Welford's method)
+struct residuals {
+    size_t n;
+    double mean;
+    double m2; // Sum of squared deviations from the mean
+    double max_abs;
+};
+
+struct comparison {
+    int failed; // Nonzero if either file could not be read
+    struct residuals seg[N_SEGMENTS];
+    struct residuals all;
+    size_t n_outside; // Log points outside the simulated time range
+};
+
+// Compares every log with the simulation (in parallel, 0 threads == one
+// per CPU); log times are shifted by offset seconds first
+void compare_logs(const char *sim_path, int n_logs, char **log_paths, double offset, int n_threads,
+                  struct comparison *results);
+double residuals_rms(const struct residuals *r); // root mean square residual
+const char *compare_segment_name(int seg);
+
+#endif
@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200809L // For fdopen, fork and pipe
+
+#include "diff.h"
+#include "log.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__linux__) || defined(__FreeBSD__)
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static pid_t pids[2]; // -1 == never started
+
+int diff_start(diff_side_fn side, FILE *rows[2]) {
+    rows[0] = rows[1] = NULL;
+    pids[0] = pids[1] = -1;
+    for (int i = 0; i < 2; i++) {
+        int fds[2];
+        if (pipe(fds)) {
+            perror("Could not create pipe");
+            return 1;
+        }
+        fflush(NULL); // Or the child would flush our buffered output again
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("Could not start side");
+            close(fds[0]);
+            close(fds[1]);
+            return 1;
+        }
+        if (pids[i] == 0) {
+            // What the side says goes to stderr, so the comparison stays on its own
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+            setvbuf(stdout, NULL, _IOLBF, 0);
+            close(fds[0]);
+            if (i == 1) fclose(rows[0]); // The other side's pipe
+            FILE *out = fdopen(fds[1], "wb");
+            int ret = out ? side(i, out) : 1;
+            if (out && fclose(out)) ret = 1;
+            log_close(); // The side never gets back to main, which would write out what it logged
+            _exit(ret);
+        }
+        close(fds[1]);
+        rows[i] = fdopen(fds[0], "rb");
+        if (!rows[i]) return 1;
+    }
+    return 0;
+}
+
+int diff_finish(FILE *rows[2], int failed[2]) {
+    for (int i = 0; i < 2; i++) {
+        // A side that outlived the other still writes its rows, so read them
+        // all: closing on it would kill it with SIGPIPE and count it as failed
+        if (rows[i]) {
+            char buf[BUFSIZ];
+            while (fread(buf, 1, sizeof(buf), rows[i]) > 0) {}
+            fclose(rows[i]);
+        }
+        int status;
+        failed[i] = pids[i] <= 0 || waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+    return failed[0] || failed[1];
+}
+
+#else
+
+int diff_start(diff_side_fn side, FILE *rows[2]) {
+    (void)side;
+    rows[0] = rows[1] = NULL;
+    puts("Side by side runs are not supported on this platform");
+    return 1;
+}
+
+int diff_finish(FILE *rows[2], int failed[2]) {
+    (void)rows;
+    failed[0] = failed[1] = 1;
+    return 1;
+}
+
+#endif
+
+int diff_read(FILE *rows[2], int n_cols, double *a, double *b) {
+    return fread(a, sizeof(double), n_cols, rows[0]) == (size_t)n_cols
+        && fread(b, sizeof(double), n_cols, rows[1]) == (size_t)n_cols;
+}
+
+void diff_init(struct diff_stats *s, int n_cols, int watch, double threshold) {
+    memset(s, 0, sizeof(*s));
+    s->n_cols = n_cols < DIFF_MAX_COLS ? n_cols : DIFF_MAX_COLS;
+    s->watch = watch;
+    s->threshold = threshold;
+    s->diverged_at = NAN;
+}
+
+void diff_add(struct diff_stats *s, const double *a, const double *b) {
+    for (int c = 0; c < s->n_cols; c++) {
+        double d = b[c] - a[c];
+        if (isnan(d)) continue; // e.g. no motor direction with serial off
+        if (fabs(d) > s->max_abs[c]) {
+            s->max_abs[c] = fabs(d);
+            s->max_at[c] = a[0];
+        }
+        s->sum_sq[c] += d * d;
+        s->last[c] = d;
+    }
+    if (isnan(s->diverged_at) && fabs(b[s->watch] - a[s->watch]) > s->threshold) {
+        s->diverged_at = a[0];
+    }
+    s->n_rows++;
+}
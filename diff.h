@@ -0,0 +1,37 @@
+// diff.h --- Runs two variants of a scenario side by side and compares them step by step
+//
+// Each side runs in its own process (the engine is global state) and sends
+// its output rows down a pipe. The rows are compared as they arrive, so the
+// sides advance in lockstep (a side can only get as far ahead as the pipe
+// holds) and neither full output is ever written. What each side prints
+// (e.g. why it stopped) goes to stderr; stdout only has the comparison.
+#ifndef _DIFF_H
+#define _DIFF_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define DIFF_MAX_COLS 16
+
+// Running comparison of the two sides (column 0 is the time)
+struct diff_stats {
+    int n_cols;
+    size_t n_rows;
+    double max_abs[DIFF_MAX_COLS]; // Largest |b - a| of each column
+    double max_at[DIFF_MAX_COLS]; // Time of the largest difference
+    double sum_sq[DIFF_MAX_COLS]; // For the RMS difference
+    double last[DIFF_MAX_COLS]; // Difference in the last row
+    int watch; // Column that decides when the sides diverged
+    double threshold; // Smallest |b - a| of the watched column that counts as diverged
+    double diverged_at; // Time the sides first diverged (NAN if they never did)
+};
+
+typedef int (*diff_side_fn)(int side, FILE *rows); // runs one side (0 or 1), writing rows of doubles; returns 0 on success
+
+int diff_start(diff_side_fn side, FILE *rows[2]); // starts both sides, returns 0 on success
+int diff_read(FILE *rows[2], int n_cols, double *a, double *b); // reads the next row of both sides, returns 0 when either ends
+int diff_finish(FILE *rows[2], int failed[2]); // waits for both sides, returns 0 if both succeeded
+void diff_init(struct diff_stats *s, int n_cols, int watch, double threshold);
+void diff_add(struct diff_stats *s, const double *a, const double *b); // adds a pair of rows
+
+#endif
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE // For O_DIRECT, fallocate and fopencookie
+
+#include "direct.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+struct direct_file {
+    int fd;
+    bool direct; // Opened with O_DIRECT
+    char *block; // Aligned buffer of DIRECT_BLOCK_LEN bytes
+    size_t fill; // Bytes waiting in block
+    off_t offset; // Where block goes in the file
+    int error; // First failed write (an errno value)
+};
+
+// Writes len bytes of the block at the current offset
+static int write_block(struct direct_file *f, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(f->fd, f->block + done, len - done, f->offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            f->error = errno;
+            return 1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static ssize_t direct_write(void *cookie, const char *buf, size_t size) {
+    struct direct_file *f = cookie;
+    size_t done = 0;
+    while (done < size && !f->error) {
+        size_t n = DIRECT_BLOCK_LEN - f->fill < size - done ? DIRECT_BLOCK_LEN - f->fill : size - done;
+        memcpy(f->block + f->fill, buf + done, n);
+        f->fill += n;
+        done += n;
+        if (f->fill == DIRECT_BLOCK_LEN && !write_block(f, DIRECT_BLOCK_LEN)) {
+            f->offset += DIRECT_BLOCK_LEN;
+            f->fill = 0;
+        }
+    }
+    if (f->error) {
+        errno = f->error;
+        return -1;
+    }
+    return done;
+}
+
+static int direct_close(void *cookie) {
+    struct direct_file *f = cookie;
+    if (f->fill && !f->error) {
+        // O_DIRECT only writes whole aligned blocks: pad this one, then cut it off
+        size_t len = f->fill;
+        if (f->direct) {
+            len = (f->fill + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+            memset(f->block + f->fill, 0, len - f->fill);
+        }
+        write_block(f, len);
+    }
+    // Drops the padding and whatever was allocated beyond the end
+    if (!f->error && ftruncate(f->fd, f->offset + f->fill)) {
+        f->error = errno;
+    }
+    int error = f->error;
+    close(f->fd);
+    free(f->block);
+    free(f);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+FILE *direct_fopen(const char *path, unsigned long long size) {
+    struct direct_file *f = calloc(1, sizeof(*f));
+    if (!f) return NULL;
+    if (posix_memalign((void **)&f->block, DIRECT_ALIGN, DIRECT_BLOCK_LEN)) {
+        free(f);
+        return NULL;
+    }
+    f->direct = true;
+    f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (f->fd < 0 && errno == EINVAL) {
+        // The file system doesn't do direct I/O
+        f->direct = false;
+        f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (f->fd < 0) {
+        free(f->block);
+        free(f);
+        return NULL;
+    }
+    // Best effort: without it the file just grows as it is written
+    if (size > 0) {
+        fallocate(f->fd, 0, 0, size);
+    }
+
+    cookie_io_functions_t io = {NULL, direct_write, NULL, direct_close};
+    FILE *stream = fopencookie(f, "w", io);
+    if (!stream) {
+        close(f->fd);
+        free(f->block);
+        free(f);
+    }
+    return stream;
+}
+
+#else
+
+FILE *direct_fopen(const char *path, unsigned long long size) {
+    (void)size;
+    return fopen(path, "w");
+}
+
+#endif
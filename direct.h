@@ -0,0 +1,20 @@
+// direct.h --- Preallocated output file written around the page cache
+//
+// For outputs of known (approximate) size: the file is allocated in one
+// piece up front (fallocate), so it isn't fragmented by other jobs writing
+// to the same storage, and written in aligned blocks with O_DIRECT, so it
+// doesn't push everybody else's data out of the page cache. The last
+// block is padded for the write and the file is cut to its real length
+// when closed. Without O_DIRECT (e.g. on tmpfs) blocks are written the
+// ordinary way.
+#ifndef _DIRECT_H
+#define _DIRECT_H
+
+#include <stdio.h>
+
+#define DIRECT_ALIGN 4096 // Alignment of blocks (offset, length and memory)
+#define DIRECT_BLOCK_LEN (1 << 20) // Bytes per write
+
+FILE *direct_fopen(const char *path, unsigned long long size); // opens path for writing about size bytes (NULL on failure)
+
+#endif
@@ -0,0 +1,359 @@
+#define _GNU_SOURCE // For pread/pwrite and flock
+
+#include "ens.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) || defined(__FreeBSD__)
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ENS_VERSION 1
+#define FILE_MAGIC "PTSIMENS"
+#define RECORD_MAGIC 0x52534E45 // "ENSR"
+
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_cols;
+    uint64_t end; // End of the last complete record
+    uint64_t last; // Start of the last complete record
+    uint64_t n_records;
+};
+
+struct record_header {
+    uint32_t magic;
+    uint32_t n_cols;
+    uint64_t record_len; // From the start of this header to the end of the record's own chunks
+    uint64_t n_rows;
+    uint64_t run_id;
+    uint32_t meta_len;
+    uint32_t reserved;
+};
+
+struct col_desc {
+    uint64_t offset;
+    uint64_t hash;
+};
+
+static size_t pad8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static int pread_all(int fd, void *buf, size_t len, uint64_t offset) {
+    char *p = buf;
+    while (len) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0) return 1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) return 1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+void ens_run_begin(struct ens_run *run, struct arena *arena, int n_cols,
+                   const char (*names)[ENS_NAME_LEN], const char *meta) {
+    run->arena = arena;
+    run->n_cols = n_cols;
+    run->names = names;
+    run->meta = meta;
+    run->n_rows = 0;
+    run->first = run->last = NULL;
+}
+
+int ens_run_add_row(struct ens_run *run, const double *row) {
+    struct ens_block *b = run->last;
+    if (!b || b->n_rows == ENS_BLOCK_ROWS) {
+        b = arena_alloc(run->arena, sizeof(struct ens_block) + (size_t)run->n_cols * ENS_BLOCK_ROWS * sizeof(double));
+        if (!b) return 1;
+        b->next = NULL;
+        b->n_rows = 0;
+        if (run->last) {
+            run->last->next = b;
+        } else {
+            run->first = b;
+        }
+        run->last = b;
+    }
+    for (int c = 0; c < run->n_cols; c++) {
+        b->cols[(size_t)c * ENS_BLOCK_ROWS + b->n_rows] = row[c];
+    }
+    b->n_rows++;
+    run->n_rows++;
+    return 0;
+}
+
+// FNV-1a over the column's bytes
+static uint64_t column_hash(struct ens_run *run, int col) {
+    uint64_t h = 14695981039346656037ULL;
+    for (struct ens_block *b = run->first; b; b = b->next) {
+        const unsigned char *p = (const unsigned char*)&b->cols[(size_t)col * ENS_BLOCK_ROWS];
+        for (size_t i = 0; i < b->n_rows * sizeof(double); i++) {
+            h = (h ^ p[i]) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+// Whether the chunk at offset holds exactly this column's data
+static int column_equals(int fd, struct ens_run *run, int col, uint64_t offset) {
+    double buf[ENS_BLOCK_ROWS];
+    for (struct ens_block *b = run->first; b; b = b->next) {
+        size_t len = b->n_rows * sizeof(double);
+        if (pread_all(fd, buf, len, offset) || memcmp(buf, &b->cols[(size_t)col * ENS_BLOCK_ROWS], len)) {
+            return 0;
+        }
+        offset += len;
+    }
+    return 1;
+}
+
+int ens_run_append(struct ens_run *run, const char *path, uint64_t *offset) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Could not open ensemble file");
+        return 1;
+    }
+
+    // Hash before taking the lock, so other writers wait as little as possible
+    struct col_desc descs[ENS_MAX_COLS];
+    for (int c = 0; c < run->n_cols; c++) {
+        descs[c].hash = column_hash(run, c);
+    }
+
+    if (flock(fd, LOCK_EX)) {
+        perror("Could not lock ensemble file");
+        close(fd);
+        return 1;
+    }
+
+    int failed = 1;
+    struct file_header fh;
+    struct stat st;
+    if (fstat(fd, &st)) goto DONE;
+    if (st.st_size == 0) {
+        // New container
+        memcpy(fh.magic, FILE_MAGIC, 8);
+        fh.version = ENS_VERSION;
+        fh.n_cols = run->n_cols;
+        fh.end = pad8(sizeof(fh) + run->n_cols * ENS_NAME_LEN);
+        fh.last = 0;
+        fh.n_records = 0;
+        char names[ENS_MAX_COLS][ENS_NAME_LEN];
+        memset(names, 0, sizeof(names));
+        memcpy(names, run->names, run->n_cols * ENS_NAME_LEN);
+        if (pwrite_all(fd, names, fh.end - sizeof(fh), sizeof(fh))) goto DONE;
+    } else if (pread_all(fd, &fh, sizeof(fh), 0) || memcmp(fh.magic, FILE_MAGIC, 8)) {
+        printf("%s is not an ensemble file\n", path);
+        goto DONE;
+    } else if ((int)fh.n_cols != run->n_cols) {
+        printf("%s has %u columns, run has %d\n", path, fh.n_cols, run->n_cols);
+        goto DONE;
+    }
+
+    // Columns identical to the previous run's are shared instead of written again
+    struct record_header prev;
+    struct col_desc prev_descs[ENS_MAX_COLS];
+    int have_prev = 0;
+    if (fh.n_records > 0 && !pread_all(fd, &prev, sizeof(prev), fh.last) && prev.magic == RECORD_MAGIC) {
+        have_prev = !pread_all(fd, prev_descs, prev.n_cols * sizeof(struct col_desc), fh.last + sizeof(prev));
+    }
+
+    struct record_header rh;
+    rh.magic = RECORD_MAGIC;
+    rh.n_cols = run->n_cols;
+    rh.n_rows = run->n_rows;
+    rh.run_id = fh.n_records;
+    rh.meta_len = strlen(run->meta);
+    rh.reserved = 0;
+
+    uint64_t start = fh.end; // Overwrites anything left by a writer that died mid-append
+    uint64_t data = start + pad8(sizeof(rh) + run->n_cols * sizeof(struct col_desc) + rh.meta_len);
+    uint64_t chunk_len = run->n_rows * sizeof(double);
+    int shared[ENS_MAX_COLS];
+    for (int c = 0; c < run->n_cols; c++) {
+        shared[c] = have_prev && prev.n_rows == rh.n_rows && prev_descs[c].hash == descs[c].hash
+            && column_equals(fd, run, c, prev_descs[c].offset);
+        if (shared[c]) {
+            descs[c].offset = prev_descs[c].offset;
+        } else {
+            descs[c].offset = data;
+            data += chunk_len;
+        }
+    }
+    rh.record_len = data - start;
+
+    // Record header, descriptors and metadata
+    if (pwrite_all(fd, &rh, sizeof(rh), start)) goto DONE;
+    if (pwrite_all(fd, descs, run->n_cols * sizeof(struct col_desc), start + sizeof(rh))) goto DONE;
+    if (pwrite_all(fd, run->meta, rh.meta_len, start + sizeof(rh) + run->n_cols * sizeof(struct col_desc))) goto DONE;
+    // Column chunks
+    for (int c = 0; c < run->n_cols; c++) {
+        if (shared[c]) continue;
+        uint64_t pos = descs[c].offset;
+        for (struct ens_block *b = run->first; b; b = b->next) {
+            if (pwrite_all(fd, &b->cols[(size_t)c * ENS_BLOCK_ROWS], b->n_rows * sizeof(double), pos)) goto DONE;
+            pos += b->n_rows * sizeof(double);
+        }
+    }
+
+    // Only now does the record become part of the file, and only once it is
+    // on disk (so a header that survives a crash never points at a lost record)
+    if (fsync(fd)) goto DONE;
+    fh.end = data;
+    fh.last = start;
+    fh.n_records++;
+    if (pwrite_all(fd, &fh, sizeof(fh), 0) || fsync(fd)) goto DONE;
+    if (offset) *offset = start;
+    failed = 0;
+
+DONE:
+    if (failed) perror("Could not append to ensemble file");
+    flock(fd, LOCK_UN);
+    close(fd);
+    return failed;
+}
+
+int ens_open(struct ens_file *ens, const char *path) {
+    ens->fd = open(path, O_RDONLY);
+    ens->runs = NULL;
+    ens->n_runs = 0;
+    if (ens->fd < 0) return 1;
+
+    struct file_header fh;
+    if (pread_all(ens->fd, &fh, sizeof(fh), 0) || memcmp(fh.magic, FILE_MAGIC, 8)
+        || fh.n_cols > ENS_MAX_COLS) {
+        close(ens->fd);
+        return 1;
+    }
+    ens->n_cols = fh.n_cols;
+    if (pread_all(ens->fd, ens->names, fh.n_cols * ENS_NAME_LEN, sizeof(fh))) {
+        close(ens->fd);
+        return 1;
+    }
+
+    // Build the directory by hopping from record to record (a damaged header
+    // can't claim more records than the file has room for)
+    struct stat st;
+    if (fstat(ens->fd, &st) || fh.n_records > (uint64_t)st.st_size / sizeof(struct record_header)) {
+        close(ens->fd);
+        return 1;
+    }
+    ens->runs = malloc(fh.n_records * sizeof(struct ens_entry) + 1);
+    if (!ens->runs) {
+        close(ens->fd);
+        return 1;
+    }
+    uint64_t pos = pad8(sizeof(fh) + fh.n_cols * ENS_NAME_LEN);
+    struct record_header rh;
+    struct col_desc descs[ENS_MAX_COLS];
+    while (pos < fh.end && ens->n_runs < fh.n_records && !pread_all(ens->fd, &rh, sizeof(rh), pos)) {
+        if (rh.magic != RECORD_MAGIC || rh.n_cols != fh.n_cols
+            || pread_all(ens->fd, descs, rh.n_cols * sizeof(struct col_desc), pos + sizeof(rh))) {
+            break;
+        }
+        struct ens_entry *e = &ens->runs[ens->n_runs++];
+        e->offset = pos;
+        e->n_rows = rh.n_rows;
+        e->run_id = rh.run_id;
+        e->meta_len = rh.meta_len;
+        for (int c = 0; c < ens->n_cols; c++) {
+            e->col_offset[c] = descs[c].offset;
+        }
+        pos += rh.record_len;
+    }
+    return 0;
+}
+
+int ens_read_meta(struct ens_file *ens, size_t run, char *buf, size_t len) {
+    if (run >= ens->n_runs || len == 0) return 1;
+    struct ens_entry *e = &ens->runs[run];
+    size_t n = e->meta_len < len - 1 ? e->meta_len : len - 1;
+    uint64_t pos = e->offset + sizeof(struct record_header) + ens->n_cols * sizeof(struct col_desc);
+    if (pread_all(ens->fd, buf, n, pos)) return 1;
+    buf[n] = '\0';
+    return 0;
+}
+
+int ens_read_column(struct ens_file *ens, size_t run, int col, double *out) {
+    if (run >= ens->n_runs || col < 0 || col >= ens->n_cols) return 1;
+    struct ens_entry *e = &ens->runs[run];
+    return pread_all(ens->fd, out, e->n_rows * sizeof(double), e->col_offset[col]);
+}
+
+int ens_read_rows(struct ens_file *ens, size_t run, int col, size_t first, size_t n, double *out) {
+    if (run >= ens->n_runs || col < 0 || col >= ens->n_cols) return 1;
+    struct ens_entry *e = &ens->runs[run];
+    if (first > e->n_rows || n > e->n_rows - first) return 1;
+    return pread_all(ens->fd, out, n * sizeof(double), e->col_offset[col] + first * sizeof(double));
+}
+
+void ens_close(struct ens_file *ens) {
+    free(ens->runs);
+    close(ens->fd);
+}
+
+#else
+
+void ens_run_begin(struct ens_run *run, struct arena *arena, int n_cols,
+                   const char (*names)[ENS_NAME_LEN], const char *meta) {
+    (void)arena; (void)names; (void)meta;
+    run->n_cols = n_cols;
+    run->n_rows = 0;
+}
+
+int ens_run_add_row(struct ens_run *run, const double *row) {
+    (void)run; (void)row;
+    return 1;
+}
+
+int ens_run_append(struct ens_run *run, const char *path, uint64_t *offset) {
+    (void)run; (void)path; (void)offset;
+    puts("Ensemble files are not supported on this platform");
+    return 1;
+}
+
+int ens_open(struct ens_file *ens, const char *path) {
+    (void)ens; (void)path;
+    puts("Ensemble files are not supported on this platform");
+    return 1;
+}
+
+int ens_read_meta(struct ens_file *ens, size_t run, char *buf, size_t len) {
+    (void)ens; (void)run; (void)buf; (void)len;
+    return 1;
+}
+
+int ens_read_column(struct ens_file *ens, size_t run, int col, double *out) {
+    (void)ens; (void)run; (void)col; (void)out;
+    return 1;
+}
+
+int ens_read_rows(struct ens_file *ens, size_t run, int col, size_t first, size_t n, double *out) {
+    (void)ens; (void)run; (void)col; (void)first; (void)n; (void)out;
+    return 1;
+}
+
+void ens_close(struct ens_file *ens) {
+    (void)ens;
+}
+
+#endif
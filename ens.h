@@ -0,0 +1,79 @@
+// ens.h --- Ensemble container: many runs (and their parameters) in one file
+//
+// Layout (integers and doubles in the writer's native byte order, which is
+// little-endian on every platform this builds on; files are not portable to
+// a big-endian machine):
+//   File header: "PTSIMENS", version, n_cols, end and start of the last
+//                complete record, number of records, then n_cols 16-byte
+//                column names
+//   Records, one per run, appended one after another:
+//     header: "ENSR", n_cols, record length, n_rows, run id, metadata length
+//     n_cols column descriptors: file offset and hash of the column chunk
+//     metadata (the run file name and its full text)
+//     column chunks (n_rows doubles each) that are not shared
+// A column descriptor may point at a chunk of an earlier run when the
+// data is identical (e.g. the time column of runs with the same length).
+// Writers take an exclusive lock while appending, so any number of
+// processes can append to the same file; readers only need the record
+// lengths to find any run. An append has reached the disk by the time it
+// returns.
+#ifndef _ENS_H
+#define _ENS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define ENS_MAX_COLS 16 // Maximum number of columns in a container
+#define ENS_NAME_LEN 16 // Length of a column name (including the terminator)
+#define ENS_BLOCK_ROWS 4096 // Rows per in-memory block while a run is being recorded
+
+// Rows of a run that is being recorded (kept in the run's arena until appended)
+struct ens_block {
+    struct ens_block *next;
+    size_t n_rows;
+    double cols[]; // n_cols columns of ENS_BLOCK_ROWS
+};
+
+struct ens_run {
+    struct arena *arena; // Where the blocks come from
+    int n_cols;
+    const char (*names)[ENS_NAME_LEN]; // Column names (only used to create the file)
+    const char *meta; // Run metadata (null-terminated text)
+    size_t n_rows;
+    struct ens_block *first, *last;
+};
+
+// One run in an opened container
+struct ens_entry {
+    uint64_t offset; // File offset of the record
+    uint64_t n_rows;
+    uint64_t run_id;
+    uint32_t meta_len;
+    uint64_t col_offset[ENS_MAX_COLS]; // Where each column's data lives
+};
+
+// An opened container (for reading)
+struct ens_file {
+    int fd;
+    int n_cols;
+    char names[ENS_MAX_COLS][ENS_NAME_LEN];
+    size_t n_runs;
+    struct ens_entry *runs;
+};
+
+// Writing
+void ens_run_begin(struct ens_run *run, struct arena *arena, int n_cols,
+                   const char (*names)[ENS_NAME_LEN], const char *meta); // starts recording a run
+int ens_run_add_row(struct ens_run *run, const double *row); // returns 0 on success
+int ens_run_append(struct ens_run *run, const char *path, uint64_t *offset); // appends the run to the container, returns 0 on success
+
+// Reading
+int ens_open(struct ens_file *ens, const char *path); // returns 0 on success
+int ens_read_meta(struct ens_file *ens, size_t run, char *buf, size_t len); // reads (at most len-1 bytes of) a run's metadata
+int ens_read_column(struct ens_file *ens, size_t run, int col, double *out); // reads a whole column (n_rows doubles)
+int ens_read_rows(struct ens_file *ens, size_t run, int col, size_t first, size_t n, double *out); // reads rows first .. first+n-1 of a column
+void ens_close(struct ens_file *ens);
+
+#endif
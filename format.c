@@ -0,0 +1,235 @@
+#define _POSIX_C_SOURCE 200809L // For sysconf and pthreads
+
+#include "format.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int format_workers = 1;
+
+#if defined(__linux__) || defined(__FreeBSD__)
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#define MIDDLE_LEN 32
+
+// Block states
+#define BLOCK_FREE 0 // Being filled by the producer (or waiting to be)
+#define BLOCK_FILLED 1 // Waiting for a worker
+#define BLOCK_FORMATTED 2 // Waiting for the committer
+
+struct block {
+    int state;
+    int n_rows;
+    double values[FORMAT_BLOCK_ROWS][FORMAT_MAX_VALUES];
+    unsigned char n_extra[FORMAT_BLOCK_ROWS];
+    char *text;
+    size_t len, cap;
+};
+
+static FILE *output;
+static int n_lead;
+static char middle[MIDDLE_LEN];
+static int n_threads, n_blocks;
+static struct block *blocks = NULL;
+static pthread_t threads[FORMAT_MAX_THREADS];
+static pthread_t committer;
+
+// Blocks are used in turn: sequence number s is blocks[s % n_blocks]
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t filled = PTHREAD_COND_INITIALIZER; // For the workers
+static pthread_cond_t formatted = PTHREAD_COND_INITIALIZER; // For the committer
+static pthread_cond_t freed = PTHREAD_COND_INITIALIZER; // For the producer
+static unsigned long fill_seq, format_seq, commit_seq; // Next block to fill, format and write
+static bool stopping;
+static int write_error;
+
+// Makes room for more than n bytes of text
+static int reserve(struct block *b, size_t n) {
+    if (b->cap - b->len > n) return 0;
+    char *text = realloc(b->text, 2*b->cap + n + 1);
+    if (!text) return 1;
+    b->text = text;
+    b->cap = 2*b->cap + n + 1;
+    return 0;
+}
+
+static void append_number(struct block *b, const char *fmt, double value) {
+    if (reserve(b, 32)) return;
+    int n = snprintf(b->text + b->len, b->cap - b->len, fmt, value);
+    if (n >= 0 && (size_t)n >= b->cap - b->len) {
+        // Huge numbers print long
+        if (reserve(b, n)) return;
+        snprintf(b->text + b->len, b->cap - b->len, fmt, value);
+    }
+    if (n > 0) b->len += n;
+}
+
+static void append_text(struct block *b, const char *text, size_t len) {
+    if (reserve(b, len)) return;
+    memcpy(b->text + b->len, text, len);
+    b->len += len;
+}
+
+static void format_block(struct block *b) {
+    size_t middle_len = strlen(middle);
+    b->len = 0;
+    for (int r = 0; r < b->n_rows; r++) {
+        const double *v = b->values[r];
+        for (int i = 0; i < n_lead; i++) {
+            append_number(b, i ? " %6lf" : "%6lf", v[i]);
+        }
+        append_text(b, middle, middle_len);
+        for (int i = 0; i < b->n_extra[r]; i++) {
+            append_number(b, " %6lf", v[n_lead + i]);
+        }
+        append_text(b, "\n", 1);
+    }
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (format_seq == fill_seq && !stopping) {
+            pthread_cond_wait(&filled, &lock);
+        }
+        if (format_seq == fill_seq) break;
+        struct block *b = &blocks[format_seq++ % n_blocks];
+        pthread_mutex_unlock(&lock);
+        format_block(b);
+        pthread_mutex_lock(&lock);
+        b->state = BLOCK_FORMATTED;
+        pthread_cond_signal(&formatted);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void *commit(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        struct block *b = &blocks[commit_seq % n_blocks];
+        while ((commit_seq == fill_seq && !stopping) || (commit_seq < fill_seq && b->state != BLOCK_FORMATTED)) {
+            pthread_cond_wait(&formatted, &lock);
+        }
+        if (commit_seq == fill_seq) break;
+        pthread_mutex_unlock(&lock);
+        if (fwrite(b->text, 1, b->len, output) != b->len) {
+            write_error = 1;
+        }
+        pthread_mutex_lock(&lock);
+        b->n_rows = 0;
+        b->state = BLOCK_FREE;
+        commit_seq++;
+        pthread_cond_signal(&freed);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int format_start(FILE *out, int lead, const char *text, int n) {
+    if (n <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? cpus / (format_workers > 0 ? format_workers : 1) : 1;
+        // One thread would only take turns with the producer for the same CPU
+        if (n < 2) return 1;
+    }
+    if (n < 1) n = 1;
+    if (n > FORMAT_MAX_THREADS) n = FORMAT_MAX_THREADS;
+    if (lead > FORMAT_MAX_VALUES) return 1;
+
+    // Enough blocks to keep every worker busy while others wait to be written
+    n_blocks = 2*n + 1;
+    blocks = calloc(n_blocks, sizeof(struct block));
+    if (!blocks) return 1;
+    output = out;
+    n_lead = lead;
+    snprintf(middle, MIDDLE_LEN, "%s", text);
+    fill_seq = format_seq = commit_seq = 0;
+    stopping = false;
+    write_error = 0;
+
+    n_threads = 0;
+    if (pthread_create(&committer, NULL, commit, NULL)) {
+        free(blocks);
+        blocks = NULL;
+        return 1;
+    }
+    while (n_threads < n && !pthread_create(&threads[n_threads], NULL, worker, NULL)) {
+        n_threads++;
+    }
+    if (!n_threads) {
+        // Nobody to format: stop the committer and let the caller write rows itself
+        format_finish();
+        return 1;
+    }
+    return 0;
+}
+
+// Hands the current block over and waits for the next one to be free
+static void submit_block() {
+    pthread_mutex_lock(&lock);
+    blocks[fill_seq % n_blocks].state = BLOCK_FILLED;
+    fill_seq++;
+    pthread_cond_signal(&filled);
+    while (blocks[fill_seq % n_blocks].state != BLOCK_FREE) {
+        pthread_cond_wait(&freed, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void format_row(const double *values, int n_extra) {
+    struct block *b = &blocks[fill_seq % n_blocks];
+    if (n_extra > FORMAT_MAX_VALUES - n_lead) n_extra = FORMAT_MAX_VALUES - n_lead;
+    memcpy(b->values[b->n_rows], values, (n_lead + n_extra) * sizeof(double));
+    b->n_extra[b->n_rows] = n_extra;
+    if (++b->n_rows == FORMAT_BLOCK_ROWS) {
+        submit_block();
+    }
+}
+
+int format_finish() {
+    if (!blocks) return 0;
+    if (blocks[fill_seq % n_blocks].n_rows > 0) {
+        submit_block();
+    }
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&filled);
+    pthread_cond_broadcast(&formatted);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_join(committer, NULL);
+
+    for (int i = 0; i < n_blocks; i++) {
+        free(blocks[i].text);
+    }
+    free(blocks);
+    blocks = NULL;
+    return write_error;
+}
+
+#else
+
+// No threads: the caller writes its rows itself
+
+int format_start(FILE *out, int lead, const char *text, int n) {
+    (void)out; (void)lead; (void)text; (void)n;
+    return 1;
+}
+
+void format_row(const double *values, int n_extra) {
+    (void)values; (void)n_extra;
+}
+
+int format_finish() {
+    return 0;
+}
+
+#endif
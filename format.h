@@ -0,0 +1,25 @@
+// format.h --- Text output rows formatted in parallel, written in order
+//
+// The producer only copies each row's numbers into a block; once a block
+// of FORMAT_BLOCK_ROWS rows is full, a worker thread turns it into text
+// while the producer carries on with the next one, and a committer thread
+// writes the finished blocks to the file in the order they were filled.
+// The text is exactly what fprintf with "%6lf" would have written.
+// Every row is: n_lead numbers separated by spaces, the middle text, then
+// its own number of extra numbers (each after a space) and a newline.
+#ifndef _FORMAT_H
+#define _FORMAT_H
+
+#include <stdio.h>
+
+#define FORMAT_BLOCK_ROWS 1024 // Rows per block
+#define FORMAT_MAX_VALUES 12 // Numbers per row (lead and extra)
+#define FORMAT_MAX_THREADS 16 // Formatting threads
+
+extern int format_workers; // Processes sharing the CPUs (e.g. batch workers), for the default thread count
+
+int format_start(FILE *out, int n_lead, const char *middle, int n_threads); // 0 threads == CPUs per worker; returns 0 on success
+void format_row(const double *values, int n_extra); // queues a row of n_lead + n_extra numbers
+int format_finish(); // writes the remaining rows and stops the threads, returns 0 if everything was written
+
+#endif
@@ -0,0 +1,357 @@
+#include "gorilla.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GORILLA_VERSION 1
+#define FILE_MAGIC "PTSIMGOR"
+
+// Most bits a value can take (XOR with a new window), and words per column
+#define MAX_VALUE_BITS 78
+#define COL_WORDS ((GORILLA_BLOCK_ROWS * MAX_VALUE_BITS + 128) / 64 + 1)
+
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_cols;
+};
+
+struct block_header {
+    uint32_t n_rows;
+    uint32_t n_words;
+};
+
+struct bit_writer {
+    uint64_t *words;
+    size_t n_words;
+    uint64_t acc; // Bits not stored yet (the last `used` bits)
+    int used;
+};
+
+struct bit_reader {
+    const uint64_t *words;
+    size_t n_words, pos;
+    uint64_t cur; // Word being read (its last `left` bits)
+    int left;
+    int overrun; // Read past the end
+};
+
+static uint64_t mask(int n) {
+    return n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+}
+
+// Writes the low n bits of value, most significant first
+static void put(struct bit_writer *w, uint64_t value, int n) {
+    if (n == 0) return;
+    value &= mask(n);
+    if (w->used + n < 64) {
+        w->acc = (w->acc << n) | value;
+        w->used += n;
+        return;
+    }
+    int first = 64 - w->used;
+    uint64_t head = value >> (n - first);
+    w->words[w->n_words++] = first == 64 ? head : (w->acc << first) | head;
+    w->acc = value & mask(n - first);
+    w->used = n - first;
+}
+
+static void put_finish(struct bit_writer *w) {
+    if (w->used) {
+        w->words[w->n_words++] = w->acc << (64 - w->used);
+        w->acc = 0;
+        w->used = 0;
+    }
+}
+
+static uint64_t get(struct bit_reader *r, int n) {
+    if (n == 0) return 0;
+    if (n <= r->left) {
+        r->left -= n;
+        return (r->cur >> r->left) & mask(n);
+    }
+    // The rest of this word, then the start of the next one
+    int rest = n - r->left;
+    uint64_t value = r->cur & mask(r->left);
+    if (r->pos == r->n_words) {
+        r->overrun = 1;
+        return 0;
+    }
+    r->cur = r->words[r->pos++];
+    r->left = 64 - rest;
+    value = rest == 64 ? r->cur : (value << rest) | (r->cur >> r->left);
+    return value;
+}
+
+static int64_t sign_extend(uint64_t value, int n) {
+    return (int64_t)(value << (64 - n)) >> (64 - n);
+}
+
+static uint64_t double_bits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static double bits_double(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Whether every value is on the time grid (and small enough for the differences to fit)
+static int on_grid(const double *v, int n) {
+    const double scale = (double)((int64_t)1 << GORILLA_TIME_BITS);
+    const double limit = (double)((int64_t)1 << 61);
+    for (int i = 0; i < n; i++) {
+        double t = v[i] * scale;
+        if (!(fabs(t) < limit) || t != floor(t) || (t == 0 && signbit(t))) return 0;
+    }
+    return 1;
+}
+
+static void encode_times(struct bit_writer *w, const double *v, int n) {
+    const double scale = (double)((int64_t)1 << GORILLA_TIME_BITS);
+    int64_t prev = (int64_t)(v[0] * scale);
+    put(w, prev, 64);
+    int64_t delta = 0;
+    for (int i = 1; i < n; i++) {
+        int64_t t = (int64_t)(v[i] * scale);
+        int64_t d = t - prev;
+        if (i == 1) {
+            put(w, d, 64);
+        } else {
+            int64_t dod = d - delta;
+            if (dod == 0) {
+                put(w, 0, 1);
+            } else if (dod >= -64 && dod < 64) {
+                put(w, 2, 2);
+                put(w, dod, 7);
+            } else if (dod >= -256 && dod < 256) {
+                put(w, 6, 3);
+                put(w, dod, 9);
+            } else if (dod >= -2048 && dod < 2048) {
+                put(w, 14, 4);
+                put(w, dod, 12);
+            } else {
+                put(w, 15, 4);
+                put(w, dod, 64);
+            }
+        }
+        delta = d;
+        prev = t;
+    }
+}
+
+static void decode_times(struct bit_reader *r, double *v, int n) {
+    const double scale = (double)((int64_t)1 << GORILLA_TIME_BITS);
+    int64_t t = (int64_t)get(r, 64);
+    v[0] = t / scale;
+    int64_t delta = 0;
+    for (int i = 1; i < n; i++) {
+        if (i == 1) {
+            delta = (int64_t)get(r, 64);
+        } else if (get(r, 1)) {
+            if (!get(r, 1)) {
+                delta += sign_extend(get(r, 7), 7);
+            } else if (!get(r, 1)) {
+                delta += sign_extend(get(r, 9), 9);
+            } else if (!get(r, 1)) {
+                delta += sign_extend(get(r, 12), 12);
+            } else {
+                delta += (int64_t)get(r, 64);
+            }
+        }
+        t += delta;
+        v[i] = t / scale;
+    }
+}
+
+static void encode_values(struct bit_writer *w, const double *v, int n) {
+    uint64_t prev = double_bits(v[0]);
+    put(w, prev, 64);
+    int lead = -1, trail = 0; // Window of the last value (none yet)
+    for (int i = 1; i < n; i++) {
+        uint64_t bits = double_bits(v[i]);
+        uint64_t x = bits ^ prev;
+        prev = bits;
+        if (!x) {
+            put(w, 0, 1);
+            continue;
+        }
+        put(w, 1, 1);
+        int l = __builtin_clzll(x), t = __builtin_ctzll(x);
+        if (lead >= 0 && l >= lead && t >= trail) {
+            put(w, 0, 1);
+            put(w, x >> trail, 64 - lead - trail);
+        } else {
+            int len = 64 - l - t;
+            put(w, 1, 1);
+            put(w, l, 6);
+            put(w, len - 1, 6);
+            put(w, x >> t, len);
+            lead = l;
+            trail = t;
+        }
+    }
+}
+
+static void decode_values(struct bit_reader *r, double *v, int n) {
+    uint64_t prev = get(r, 64);
+    v[0] = bits_double(prev);
+    int lead = 0, trail = 0;
+    for (int i = 1; i < n; i++) {
+        if (get(r, 1)) {
+            if (get(r, 1)) {
+                lead = (int)get(r, 6);
+                trail = 64 - lead - ((int)get(r, 6) + 1);
+                if (trail < 0) {
+                    r->overrun = 1;
+                    return;
+                }
+            }
+            prev ^= get(r, 64 - lead - trail) << trail;
+        }
+        v[i] = bits_double(prev);
+    }
+}
+
+static int write_block(struct gorilla_writer *w) {
+    if (!w->n_rows) return 0;
+    struct bit_writer bits = {w->words, 0, 0, 0};
+    for (int c = 0; c < w->n_cols; c++) {
+        const double *v = w->cols + (size_t)c * GORILLA_BLOCK_ROWS;
+        if (on_grid(v, w->n_rows)) {
+            put(&bits, 1, 1);
+            encode_times(&bits, v, w->n_rows);
+        } else {
+            put(&bits, 0, 1);
+            encode_values(&bits, v, w->n_rows);
+        }
+    }
+    put_finish(&bits);
+    struct block_header bh = {w->n_rows, bits.n_words};
+    if (fwrite(&bh, sizeof(bh), 1, w->f) != 1 || fwrite(w->words, sizeof(uint64_t), bits.n_words, w->f) != bits.n_words) {
+        return 1;
+    }
+    w->total_rows += w->n_rows;
+    w->total_bytes += sizeof(bh) + bits.n_words * sizeof(uint64_t);
+    w->n_rows = 0;
+    return 0;
+}
+
+int gorilla_open(struct gorilla_writer *w, const char *path, int n_cols, const char (*names)[GORILLA_NAME_LEN]) {
+    memset(w, 0, sizeof(*w));
+    if (n_cols < 1 || n_cols > GORILLA_MAX_COLS) return 1;
+    w->n_cols = n_cols;
+    w->cols = malloc((size_t)n_cols * GORILLA_BLOCK_ROWS * sizeof(double));
+    w->words = malloc((size_t)n_cols * COL_WORDS * sizeof(uint64_t));
+    w->f = fopen(path, "wb");
+    if (!w->cols || !w->words || !w->f) {
+        if (w->f) fclose(w->f);
+        free(w->cols);
+        free(w->words);
+        return 1;
+    }
+    struct file_header fh;
+    memcpy(fh.magic, FILE_MAGIC, 8);
+    fh.version = GORILLA_VERSION;
+    fh.n_cols = n_cols;
+    char padded[GORILLA_MAX_COLS][GORILLA_NAME_LEN];
+    memset(padded, 0, sizeof(padded));
+    for (int c = 0; c < n_cols; c++) {
+        strncpy(padded[c], names[c], GORILLA_NAME_LEN - 1);
+    }
+    fwrite(&fh, sizeof(fh), 1, w->f);
+    fwrite(padded, GORILLA_NAME_LEN, n_cols, w->f);
+    w->total_bytes = sizeof(fh) + n_cols * GORILLA_NAME_LEN;
+    return 0;
+}
+
+int gorilla_add(struct gorilla_writer *w, const double *row) {
+    for (int c = 0; c < w->n_cols; c++) {
+        w->cols[(size_t)c * GORILLA_BLOCK_ROWS + w->n_rows] = row[c];
+    }
+    if (++w->n_rows == GORILLA_BLOCK_ROWS) {
+        return write_block(w);
+    }
+    return 0;
+}
+
+int gorilla_close(struct gorilla_writer *w) {
+    int failed = write_block(w);
+    failed |= fclose(w->f) != 0;
+    free(w->cols);
+    free(w->words);
+    w->f = NULL;
+    return failed;
+}
+
+int gorilla_read_open(struct gorilla_reader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->f = fopen(path, "rb");
+    if (!r->f) return 1;
+    struct file_header fh;
+    if (fread(&fh, sizeof(fh), 1, r->f) != 1 || memcmp(fh.magic, FILE_MAGIC, 8) || fh.version != GORILLA_VERSION
+        || fh.n_cols < 1 || fh.n_cols > GORILLA_MAX_COLS
+        || fread(r->names, GORILLA_NAME_LEN, fh.n_cols, r->f) != fh.n_cols) {
+        fclose(r->f);
+        return 1;
+    }
+    r->n_cols = fh.n_cols;
+    for (int c = 0; c < r->n_cols; c++) {
+        r->names[c][GORILLA_NAME_LEN - 1] = '\0';
+    }
+    r->cols = malloc((size_t)r->n_cols * GORILLA_BLOCK_ROWS * sizeof(double));
+    r->words = malloc((size_t)r->n_cols * COL_WORDS * sizeof(uint64_t));
+    if (!r->cols || !r->words) {
+        gorilla_read_close(r);
+        return 1;
+    }
+    return 0;
+}
+
+// Decodes the next block, returns 1 if there was one, 0 at the end, -1 if damaged
+static int read_block(struct gorilla_reader *r) {
+    struct block_header bh;
+    if (fread(&bh, sizeof(bh), 1, r->f) != 1) return 0;
+    if (bh.n_rows < 1 || bh.n_rows > GORILLA_BLOCK_ROWS || bh.n_words > (size_t)r->n_cols * COL_WORDS
+        || fread(r->words, sizeof(uint64_t), bh.n_words, r->f) != bh.n_words) {
+        return -1;
+    }
+    struct bit_reader bits = {r->words, bh.n_words, 0, 0, 0, 0};
+    for (int c = 0; c < r->n_cols; c++) {
+        double *v = r->cols + (size_t)c * GORILLA_BLOCK_ROWS;
+        if (get(&bits, 1)) {
+            decode_times(&bits, v, bh.n_rows);
+        } else {
+            decode_values(&bits, v, bh.n_rows);
+        }
+    }
+    if (bits.overrun) return -1;
+    r->n_rows = bh.n_rows;
+    r->row = 0;
+    return 1;
+}
+
+int gorilla_next(struct gorilla_reader *r, double *row) {
+    if (r->row == r->n_rows) {
+        int got = read_block(r);
+        if (got <= 0) return got;
+    }
+    for (int c = 0; c < r->n_cols; c++) {
+        row[c] = r->cols[(size_t)c * GORILLA_BLOCK_ROWS + r->row];
+    }
+    r->row++;
+    return 1;
+}
+
+void gorilla_read_close(struct gorilla_reader *r) {
+    if (r->f) fclose(r->f);
+    free(r->cols);
+    free(r->words);
+    r->f = NULL;
+    r->cols = NULL;
+    r->words = NULL;
+}
@@ -0,0 +1,58 @@
+// gorilla.h --- Compressed output: delta-of-delta times and XOR-encoded doubles
+//
+// Layout (integers in the writer's native byte order, which is little-endian
+// on every platform this builds on; files are not portable to a big-endian
+// machine):
+//   File header: "PTSIMGOR", version, n_cols, then n_cols 16-byte column names
+//   Blocks of up to GORILLA_BLOCK_ROWS rows: n_rows, n_words, then n_words
+//   64-bit words of bits (filled from the most significant bit), holding
+//   each column of the block in turn
+// Every column of a block starts with a mode bit:
+//   1: times on a 2^-GORILLA_TIME_BITS s grid (always the case for steady
+//      steps): the first as a 64-bit integer count, the first difference,
+//      then the change of difference in 1, 9, 12, 16 or 68 bits
+//   0: any doubles: the first one, then each XORed with the one before;
+//      equal values take 1 bit, others only their bits that differ (within
+//      the window of the last value when they fit)
+// Slowly varying columns (frequency, polarization, steady state) come out
+// at a few bits per value, and a block at a time can be decoded while
+// reading (a reader never holds more than one block).
+#ifndef _GORILLA_H
+#define _GORILLA_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define GORILLA_MAX_COLS 16
+#define GORILLA_NAME_LEN 16 // Length of a column name (including the terminator)
+#define GORILLA_BLOCK_ROWS 4096
+#define GORILLA_TIME_BITS 20 // Fraction bits of the time grid
+
+struct gorilla_writer {
+    FILE *f;
+    int n_cols;
+    int n_rows; // Rows in the current block
+    double *cols; // n_cols columns of GORILLA_BLOCK_ROWS
+    uint64_t *words; // Encoded block
+    unsigned long total_rows;
+    unsigned long long total_bytes;
+};
+
+struct gorilla_reader {
+    FILE *f;
+    int n_cols;
+    char names[GORILLA_MAX_COLS][GORILLA_NAME_LEN];
+    int n_rows, row; // Rows in the current block, next one to return
+    double *cols;
+    uint64_t *words;
+};
+
+int gorilla_open(struct gorilla_writer *w, const char *path, int n_cols, const char (*names)[GORILLA_NAME_LEN]); // returns 0 on success
+int gorilla_add(struct gorilla_writer *w, const double *row); // appends a row of n_cols values, returns 0 on success
+int gorilla_close(struct gorilla_writer *w); // writes the last block, returns 0 on success
+
+int gorilla_read_open(struct gorilla_reader *r, const char *path); // returns 0 on success
+int gorilla_next(struct gorilla_reader *r, double *row); // 1 with the next row, 0 at the end, -1 if the file is damaged
+void gorilla_read_close(struct gorilla_reader *r);
+
+#endif
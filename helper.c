@@ -1,8 +1,16 @@
+#define _POSIX_C_SOURCE 200809L // For fsync
+
 #include "helper.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 void strip_newline(char *str) {
     int i = 0;
     while (str[i] != '\n' && str[i] != '\r') i++;
@@ -11,8 +19,8 @@ void strip_newline(char *str) {
 
 void strip_extension(char *str) {
     int i = strlen(str) - 1;
-    while (str[i] != '.') i--;
-    str[i] = '\0';
+    while (i >= 0 && str[i] != '.') i--;
+    if (i >= 0) str[i] = '\0';
 }
 
 int get_port(char *port_name) {
@@ -23,3 +31,25 @@ int get_port(char *port_name) {
         return -1;
     }
 }
+
+void remove_if_empty(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    int c = fgetc(f);
+    fclose(f);
+    if (c == EOF) remove(path);
+}
+
+int sync_file(const char *path) {
+#if defined(__linux__) || defined(__FreeBSD__)
+    // Whoever wrote it may have closed it already (the data is synced, not the descriptor)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+    int failed = fsync(fd) != 0;
+    close(fd);
+    return failed;
+#else
+    (void)path;
+    return 0;
+#endif
+}
@@ -6,5 +6,7 @@
 void strip_newline(char *str); // Modifies str to only refer to its first line, without trailing newlines
 void strip_extension(char *str); // Strips the file extension from str
 int get_port(char *port_name); // Computes the port number from COM (e.g. COM8 -> 7)
+void remove_if_empty(const char *path); // Deletes the file at path if there is nothing in it
+int sync_file(const char *path); // Waits until the file at path is on disk, returns 0 on success
 
 #endif
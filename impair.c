@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L // For clock_gettime and nanosleep
+
+#include "impair.h"
+
+#include <stdio.h>
+
+bool impair_on = false;
+
+#if defined(__linux__) || defined(__FreeBSD__)
+
+#include <math.h>
+#include <time.h>
+
+#define IDLE_WAIT 100e-6 // Longest sleep while waiting for a byte, in seconds
+
+// Bytes on their way along the emulated line, in the order they were sent
+struct line {
+    uint8_t bytes[IMPAIR_QUEUE_LEN];
+    double due[IMPAIR_QUEUE_LEN]; // When each byte comes out
+    unsigned long head, tail;
+    double free_at; // When the line has finished sending the last byte
+    double last_due; // Bytes never overtake each other
+    uint64_t rng; // Each direction has its own, so timing can't change which bytes are hit
+    unsigned long sent, dropped, corrupted;
+};
+
+static struct impair_params params;
+static impair_read_fn port_read;
+static impair_write_fn port_write;
+static struct line from_box, to_box;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void pause_for(double seconds) {
+    if (seconds <= 0) return;
+    if (seconds > IDLE_WAIT) seconds = IDLE_WAIT;
+    struct timespec ts = {0, (long)(seconds*1e9)};
+    nanosleep(&ts, NULL);
+}
+
+// splitmix64, uniform in [0, 1)
+static double uniform(struct line *l) {
+    uint64_t z = (l->rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return (z >> 11) * 0x1.0p-53;
+}
+
+static bool line_full(const struct line *l) {
+    return l->head - l->tail == IMPAIR_QUEUE_LEN;
+}
+
+// Puts a byte on the line at time t (it may be lost or damaged on the way)
+static void line_send(struct line *l, uint8_t byte, double t) {
+    l->sent++;
+    if (params.drop > 0 && uniform(l) < params.drop) {
+        l->dropped++;
+        return;
+    }
+    if (params.corrupt > 0 && uniform(l) < params.corrupt) {
+        byte ^= 1 << (int)(uniform(l) * 8);
+        l->corrupted++;
+    }
+    // The line is busy for a byte time, then the byte takes the latency (and jitter) to arrive
+    double done = t;
+    if (params.baud > 0) {
+        done = fmax(t, l->free_at) + (double)IMPAIR_BITS_PER_BYTE / params.baud;
+        l->free_at = done;
+    }
+    double due = done + params.latency + (params.jitter > 0 ? params.jitter * uniform(l) : 0.0);
+    l->last_due = fmax(due, l->last_due);
+    l->bytes[l->head % IMPAIR_QUEUE_LEN] = byte;
+    l->due[l->head % IMPAIR_QUEUE_LEN] = l->last_due;
+    l->head++;
+}
+
+// Takes the next byte off the line if it has arrived by time t
+static int line_receive(struct line *l, uint8_t *byte, double t) {
+    if (l->head == l->tail || l->due[l->tail % IMPAIR_QUEUE_LEN] > t) return 0;
+    *byte = l->bytes[l->tail % IMPAIR_QUEUE_LEN];
+    l->tail++;
+    return 1;
+}
+
+// Seconds until the next byte arrives (IDLE_WAIT if the line is empty)
+static double line_wait(const struct line *l, double t) {
+    if (l->head == l->tail) return IDLE_WAIT;
+    return l->due[l->tail % IMPAIR_QUEUE_LEN] - t;
+}
+
+// Moves bytes along both lines: what the box sent goes on the line to us,
+// what has made it to the box's end goes out of the port
+static double pump() {
+    double t = now();
+    uint8_t byte;
+    while (line_receive(&to_box, &byte, t)) {
+        port_write(byte);
+    }
+    while (!line_full(&from_box) && port_read(&byte)) {
+        line_send(&from_box, byte, t);
+    }
+    return t;
+}
+
+int impair_start(const struct impair_params *p, impair_read_fn read, impair_write_fn write) {
+    if (impair_on) impair_stop();
+    if (p->baud < 0 || p->latency < 0 || p->jitter < 0 || p->drop < 0 || p->drop > 1
+        || p->corrupt < 0 || p->corrupt > 1) {
+        return 1;
+    }
+    params = *p;
+    port_read = read;
+    port_write = write;
+    struct line empty = {0};
+    from_box = empty;
+    to_box = empty;
+    from_box.rng = p->seed;
+    to_box.rng = ~p->seed;
+    impair_on = true;
+    return 0;
+}
+
+void impair_stop() {
+    if (!impair_on) return;
+    // Whatever we sent still reaches the box; what it sent that we haven't read is lost
+    while (to_box.head != to_box.tail) {
+        double t = pump();
+        pause_for(line_wait(&to_box, t));
+    }
+    impair_on = false;
+    printf("Line from the box: %lu bytes, %lu dropped, %lu corrupted\n", from_box.sent, from_box.dropped, from_box.corrupted);
+    printf("Line to the box: %lu bytes, %lu dropped, %lu corrupted\n", to_box.sent, to_box.dropped, to_box.corrupted);
+}
+
+int impair_read(uint8_t *byte, bool wait) {
+    while (true) {
+        double t = pump();
+        if (line_receive(&from_box, byte, t)) return 1;
+        if (!wait) return 0;
+        pause_for(fmin(line_wait(&from_box, t), line_wait(&to_box, t)));
+    }
+}
+
+void impair_write(uint8_t byte) {
+    double t = pump();
+    while (line_full(&to_box)) {
+        // The line is backed up, so the sender waits (as it would on a slow UART)
+        pause_for(line_wait(&to_box, t));
+        t = pump();
+    }
+    line_send(&to_box, byte, t);
+}
+
+#else
+
+int impair_start(const struct impair_params *p, impair_read_fn read, impair_write_fn write) {
+    (void)p; (void)read; (void)write;
+    return 1;
+}
+
+void impair_stop() {
+}
+
+int impair_read(uint8_t *byte, bool wait) {
+    (void)byte; (void)wait;
+    return 0;
+}
+
+void impair_write(uint8_t byte) {
+    (void)byte;
+}
+
+#endif
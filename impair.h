@@ -0,0 +1,41 @@
+// impair.h --- Emulated line impairments between the simulation and the box
+//
+// A pty (or a box emulator on one) answers at once and never loses a byte,
+// so timing the protocol loop on it says nothing about the real 9600 baud
+// line. With impairments on, every byte in either direction waits in a
+// queue until the emulated line would have delivered it: a start and a
+// stop bit per byte at the set baud rate (bytes queue up behind each
+// other), then a fixed latency plus a random jitter. Bytes can also be
+// dropped, or arrive with one bit flipped. The randomness has its own
+// generator with its own seed, so the same bytes are lost on every run.
+// A recording (sim -R) holds the bytes as they were delivered, so its
+// replay sees the same damage without emulating the line.
+#ifndef _IMPAIR_H
+#define _IMPAIR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define IMPAIR_QUEUE_LEN 4096 // Bytes held back per direction
+#define IMPAIR_BITS_PER_BYTE 10 // 8N1: a start bit, 8 data bits and a stop bit
+
+struct impair_params {
+    int baud; // 0 == as fast as the port goes
+    double latency; // Seconds added to every byte
+    double jitter; // Up to this many more seconds (uniformly distributed)
+    double drop; // Probability of losing a byte
+    double corrupt; // Probability of flipping one bit of a byte
+    uint64_t seed;
+};
+
+typedef int (*impair_read_fn)(uint8_t *byte); // receives a byte from the port without waiting (returns 1 if there was one)
+typedef void (*impair_write_fn)(uint8_t byte); // sends a byte to the port
+
+extern bool impair_on; // Whether bytes go through the emulated line
+
+int impair_start(const struct impair_params *params, impair_read_fn read, impair_write_fn write); // returns 0 on success
+void impair_stop(); // sends whatever is still queued for the box (in its own time) and prints what the line did
+int impair_read(uint8_t *byte, bool wait); // next byte from the box that is due (0 if none and not waiting)
+void impair_write(uint8_t byte); // queues a byte for the box (waiting for room if the line is backed up)
+
+#endif
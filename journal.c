@@ -0,0 +1,100 @@
+#define _POSIX_C_SOURCE 200809L // For fileno and fsync
+
+#include "journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_LEN 1024
+
+int journal_open(struct journal *j, const char *path, int n_jobs, char **files) {
+    j->n_jobs = n_jobs;
+    j->files = files;
+    j->done = calloc(n_jobs, sizeof(bool));
+    j->offset = calloc(n_jobs, sizeof(uint64_t));
+    if (!j->done || !j->offset) {
+        free(j->done);
+        free(j->offset);
+        return 1;
+    }
+
+    // Replay what earlier sessions got done
+    j->id[0] = '\0';
+    bool torn = false;
+    FILE *f = fopen(path, "r");
+    if (f) {
+        char line[LINE_LEN];
+        int n_done = 0;
+        while (fgets(line, LINE_LEN, f)) {
+            int job;
+            unsigned long long offset;
+            int name_pos;
+            size_t len = strlen(line);
+            if (len == 0 || line[len - 1] != '\n') {
+                torn = true; // Partly written line at the end of the journal
+                break;
+            }
+            line[len - 1] = '\0';
+            if (!j->id[0] && sscanf(line, "batch %31s", j->id) == 1) {
+                continue;
+            }
+            if (sscanf(line, "done %d %llu %n", &job, &offset, &name_pos) < 2) {
+                continue;
+            }
+            if (job < 0 || job >= n_jobs) {
+                continue;
+            }
+            // Only trust the entry if it still refers to the same run file
+            if (strcmp(line + name_pos, files[job])) {
+                printf("Journal: job %d was %s, now %s; running it again\n", job, line + name_pos, files[job]);
+                continue;
+            }
+            if (!j->done[job]) n_done++;
+            j->done[job] = true;
+            j->offset[job] = offset;
+        }
+        fclose(f);
+        printf("Journal: %d of %d jobs already finished\n", n_done, n_jobs);
+    }
+
+    j->file = fopen(path, "a");
+    if (!j->file) {
+        free(j->done);
+        free(j->offset);
+        return 1;
+    }
+    if (torn) {
+        // Terminate the partial line so it can't swallow the next entry
+        fputc('\n', j->file);
+        fflush(j->file);
+    }
+    if (!j->id[0]) {
+        // New journal (or one from before batches had ids)
+        snprintf(j->id, JOURNAL_ID_LEN, "%lx-%lx", (unsigned long)time(NULL), (unsigned long)getpid());
+        fprintf(j->file, "batch %s\n", j->id);
+        fflush(j->file);
+    }
+    return 0;
+}
+
+void journal_start(struct journal *j, int job) {
+    // Not synced: a lost start line only means the job is redone anyway
+    fprintf(j->file, "start %d %s\n", job, j->files[job]);
+    fflush(j->file);
+}
+
+void journal_done(struct journal *j, int job, uint64_t offset) {
+    fprintf(j->file, "done %d %llu %s\n", job, (unsigned long long)offset, j->files[job]);
+    fflush(j->file);
+    fsync(fileno(j->file));
+    j->done[job] = true;
+    j->offset[job] = offset;
+}
+
+void journal_close(struct journal *j) {
+    fclose(j->file);
+    free(j->done);
+    free(j->offset);
+}
@@ -0,0 +1,35 @@
+// journal.h --- Append-only job journal, so an interrupted batch can be resumed
+//
+// The first line names the batch:
+//   batch <id>
+// (so results it stored elsewhere can be told apart from other batches'),
+// and each line after that is either
+//   start <job> <file>
+//   done <job> <offset> <file>
+// where offset is where the job's result was stored (e.g. in an ensemble file).
+// Lines are flushed to disk as they are written, and a partly written last
+// line (from a crash) is ignored when the journal is read back.
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#define JOURNAL_ID_LEN 32 // Length of a batch id (including the terminator)
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct journal {
+    FILE *file;
+    char id[JOURNAL_ID_LEN]; // Same for every session of the batch
+    int n_jobs;
+    char **files; // Run file of each job
+    bool *done; // Whether each job finished in a previous session
+    uint64_t *offset; // Result offset of each finished job
+};
+
+int journal_open(struct journal *j, const char *path, int n_jobs, char **files); // reads past progress and opens for appending, returns 0 on success
+void journal_start(struct journal *j, int job); // records that a job was started
+void journal_done(struct journal *j, int job, uint64_t offset); // records that a job finished (durably)
+void journal_close(struct journal *j);
+
+#endif
@@ -0,0 +1,72 @@
+#define _POSIX_C_SOURCE 200809L // For clock_gettime
+
+#include "kalman.h"
+
+#include <string.h>
+#include <time.h>
+
+// Noise levels (rough, in fractions of full polarization)
+const double Q_POL = 1e-8; // The model's polarization error grows this much per second
+const double Q_DRIFT = 1e-13; // The rate drift wanders this much per second
+const double R_RATE = 1e-8; // Noise of the box's rate
+const double INITIAL_VAR_POL = 1e-4;
+const double INITIAL_VAR_DRIFT = 1e-8;
+
+void kalman_init(struct kalman *k, double pol, double budget) {
+    memset(k, 0, sizeof(*k));
+    k->x[0] = pol;
+    k->p[0][0] = INITIAL_VAR_POL;
+    k->p[1][1] = INITIAL_VAR_DRIFT;
+    k->q_pol = Q_POL;
+    k->q_drift = Q_DRIFT;
+    k->r_rate = R_RATE;
+    k->budget = budget;
+}
+
+void kalman_predict(struct kalman *k, double lambda, double ss, double dt) {
+    // x = F*x (plus the pull towards the steady state), P = F*P*F' + Q
+    // with F = [1 - lambda*dt, dt; 0, 1]
+    double f00 = 1 - lambda*dt;
+    k->x[0] += dt*(lambda*(ss - k->x[0]) + k->x[1]);
+    double p00 = k->p[0][0], p01 = k->p[0][1], p11 = k->p[1][1];
+    k->p[0][0] = f00*f00*p00 + 2*f00*dt*p01 + dt*dt*p11 + k->q_pol*dt;
+    k->p[0][1] = k->p[1][0] = f00*p01 + dt*p11;
+    k->p[1][1] = p11 + k->q_drift*dt;
+}
+
+int kalman_update(struct kalman *k, double lambda, double ss, double rate, double used) {
+    if (used > k->budget) {
+        k->n_skipped++;
+        return 0;
+    }
+    // Observation: rate = lambda*(ss - P) + d, so H = [-lambda, 1]
+    double innovation = rate - (lambda*(ss - k->x[0]) + k->x[1]);
+    double ph0 = -lambda*k->p[0][0] + k->p[0][1]; // (P*H')[0]
+    double ph1 = -lambda*k->p[1][0] + k->p[1][1]; // (P*H')[1]
+    double s = -lambda*ph0 + ph1 + k->r_rate;
+    double k0 = ph0 / s, k1 = ph1 / s;
+    k->x[0] += k0*innovation;
+    k->x[1] += k1*innovation;
+    // P = P - K*S*K' (stays symmetric)
+    k->p[0][0] -= k0*k0*s;
+    k->p[0][1] = k->p[1][0] = k->p[0][1] - k0*k1*s;
+    k->p[1][1] -= k1*k1*s;
+    return 1;
+}
+
+void kalman_latency(struct kalman *k, double tick_time) {
+    k->n_ticks++;
+    k->latency_sum += tick_time;
+    if (tick_time > k->latency_max) k->latency_max = tick_time;
+    if (tick_time > k->budget) k->n_over++;
+}
+
+double kalman_clock() {
+#if defined(__linux__) || defined(__FreeBSD__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
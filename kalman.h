@@ -0,0 +1,33 @@
+// kalman.h --- Online estimate of the polarization from what the box observes
+//
+// Kalman filter on the state (P, d): the polarization and a drift of the
+// polarization rate that the model does not account for.
+//   dP/dt = lambda*(P_infinity - P) + d (d wanders as a random walk)
+// The box's polarization rate is the observation, so the estimate follows
+// the real target instead of drifting away on the model alone.
+// Every tick has a compute budget: if the tick has already used it up
+// (e.g. a long burst of serial traffic), the update is skipped and the
+// estimate only coasts on the model until the next tick.
+#ifndef _KALMAN_H
+#define _KALMAN_H
+
+struct kalman {
+    double x[2]; // Estimated polarization and rate drift (per second)
+    double p[2][2]; // Covariance of the estimate
+    double q_pol, q_drift; // Process noise (variance added per second)
+    double r_rate; // Variance of the observed polarization rate
+    double budget; // Seconds of compute allowed per tick
+    // Latency of the ticks, as measured
+    unsigned long n_ticks;
+    unsigned long n_skipped; // Updates skipped for lack of time
+    unsigned long n_over; // Ticks that took longer than the budget
+    double latency_sum, latency_max;
+};
+
+void kalman_init(struct kalman *k, double pol, double budget); // starts from pol, budget in seconds
+void kalman_predict(struct kalman *k, double lambda, double ss, double dt); // advances the estimate by dt
+int kalman_update(struct kalman *k, double lambda, double ss, double rate, double used); // folds in an observed rate, given the time the tick has used so far; returns 0 if skipped
+void kalman_latency(struct kalman *k, double tick_time); // records how long a whole tick took
+double kalman_clock(); // monotonic time in seconds
+
+#endif
@@ -0,0 +1,262 @@
+#define _POSIX_C_SOURCE 200809L // For clock_gettime, nanosleep and pthreads
+
+#include "log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_LINE_LEN 256 // Longer messages are cut short (and end in "..."); a whole box message fits
+#define RING_SLOTS 1024 // Messages a thread can have waiting
+#define MAX_RINGS 8 // Threads that can log
+
+static const char *LEVEL_NAMES[] = {"debug", "info", "warn", "error"};
+
+static int terminal_level = LOG_DEBUG;
+static FILE *log_file = NULL;
+
+#if (defined(__linux__) || defined(__FreeBSD__)) && defined(__GNUC__)
+
+#include <pthread.h>
+#include <stdbool.h>
+
+struct slot {
+    int level;
+    struct timespec time;
+    char text[LOG_LINE_LEN];
+};
+
+// Single producer (the owning thread), single consumer (whoever holds drain_lock)
+struct ring {
+    unsigned long head; // Next slot to write (only the producer moves it)
+    unsigned long tail; // Next slot to read (only the consumer moves it)
+    unsigned long dropped; // Messages lost to a full ring
+    struct slot slots[RING_SLOTS];
+};
+
+static struct ring rings[MAX_RINGS];
+static int n_rings = 0;
+static __thread struct ring *my_ring = NULL;
+
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t drain_thread;
+static bool running = false;
+static bool stopping = false;
+static bool atfork_set = false;
+
+// Terminal rate limiting (token bucket, only touched while draining)
+static double tokens = LOG_RATE;
+static double last_refill = 0;
+static unsigned long n_skipped = 0;
+
+static double seconds(const struct timespec *ts) {
+    return ts->tv_sec + ts->tv_nsec*1e-9;
+}
+
+static void write_slot(const struct slot *s) {
+    if (log_file) {
+        char stamp[32];
+        struct tm tm;
+        localtime_r(&s->time.tv_sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        fprintf(log_file, "%s.%03ld %-5s %s\n", stamp, s->time.tv_nsec / 1000000, LEVEL_NAMES[s->level], s->text);
+    }
+    if (s->level < terminal_level) return;
+
+    double now = seconds(&s->time);
+    tokens += (now - last_refill) * LOG_RATE;
+    if (tokens > LOG_RATE) tokens = LOG_RATE;
+    last_refill = now;
+    if (tokens < 1) {
+        n_skipped++;
+        return;
+    }
+    tokens -= 1;
+    if (n_skipped) {
+        printf("(%lu messages not shown)\n", n_skipped);
+        n_skipped = 0;
+    }
+    puts(s->text);
+}
+
+// Writes out every waiting message, returns how many there were (call with drain_lock held)
+static int drain() {
+    int n = 0;
+    int count = __atomic_load_n(&n_rings, __ATOMIC_ACQUIRE);
+    if (count > MAX_RINGS) count = MAX_RINGS;
+    for (int r = 0; r < count; r++) {
+        struct ring *ring = &rings[r];
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (; ring->tail != head; ring->tail++, n++) {
+            write_slot(&ring->slots[ring->tail % RING_SLOTS]);
+        }
+        __atomic_store_n(&ring->tail, ring->tail, __ATOMIC_RELEASE);
+        unsigned long dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_ACQ_REL);
+        if (dropped) {
+            printf("(%lu messages dropped)\n", dropped);
+        }
+    }
+    if (n) {
+        fflush(stdout);
+        if (log_file) fflush(log_file);
+    }
+    return n;
+}
+
+static void *drain_loop(void *arg) {
+    (void)arg;
+    const struct timespec nap = {0, 1000000}; // 1 ms
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&drain_lock);
+        int n = drain();
+        pthread_mutex_unlock(&drain_lock);
+        if (!n) nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+// A forked child starts with no drain thread (and must not wait for one
+// that was in the middle of writing)
+static void before_fork() {
+    pthread_mutex_lock(&drain_lock);
+}
+
+static void after_fork_parent() {
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void after_fork_child() {
+    pthread_mutex_unlock(&drain_lock);
+    pthread_mutex_init(&start_lock, NULL);
+    running = false;
+    stopping = false;
+    // The parent's waiting messages are the parent's to write
+    for (int r = 0; r < MAX_RINGS; r++) {
+        rings[r].head = rings[r].tail = rings[r].dropped = 0;
+    }
+    n_rings = 0;
+    my_ring = NULL;
+}
+
+static void start() {
+    pthread_mutex_lock(&start_lock);
+    if (!atfork_set) {
+        pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+        atfork_set = true;
+    }
+    if (!running) {
+        stopping = false;
+        running = !pthread_create(&drain_thread, NULL, drain_loop, NULL);
+    }
+    pthread_mutex_unlock(&start_lock);
+}
+
+// The calling thread's ring (NULL if every ring is taken)
+static struct ring *get_ring() {
+    if (!my_ring) {
+        int r = __atomic_fetch_add(&n_rings, 1, __ATOMIC_ACQ_REL);
+        if (r >= MAX_RINGS) return NULL;
+        my_ring = &rings[r];
+    }
+    return my_ring;
+}
+
+void log_msg(int level, const char *format, ...) {
+    if (level < terminal_level && !log_file) return;
+    if (!running) start();
+    struct ring *ring = get_ring();
+    if (!ring) return;
+
+    unsigned long head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SLOTS) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct slot *s = &ring->slots[head % RING_SLOTS];
+    s->level = level;
+    clock_gettime(CLOCK_REALTIME, &s->time);
+    va_list args;
+    va_start(args, format);
+    if (vsnprintf(s->text, LOG_LINE_LEN, format, args) >= LOG_LINE_LEN) {
+        memcpy(s->text + LOG_LINE_LEN - 4, "...", 4);
+    }
+    va_end(args);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void log_flush() {
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+void log_close() {
+    if (running) {
+        __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+        pthread_join(drain_thread, NULL);
+        running = false;
+    }
+    log_flush();
+    if (n_skipped) {
+        printf("(%lu messages not shown)\n", n_skipped);
+        n_skipped = 0;
+    }
+    if (log_file) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+}
+
+#else
+
+// No threads: write straight away (without timestamps or rate limiting)
+
+void log_msg(int level, const char *format, ...) {
+    va_list args;
+    if (log_file) {
+        fprintf(log_file, "%-5s ", LEVEL_NAMES[level]);
+        va_start(args, format);
+        vfprintf(log_file, format, args);
+        va_end(args);
+        fputc('\n', log_file);
+    }
+    if (level >= terminal_level) {
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        putchar('\n');
+    }
+}
+
+void log_flush() {
+    fflush(stdout);
+    if (log_file) fflush(log_file);
+}
+
+void log_close() {
+    log_flush();
+    if (log_file) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+}
+
+#endif
+
+int log_open(const char *path) {
+    log_file = fopen(path, "a");
+    return !log_file;
+}
+
+void log_set_level(int level) {
+    terminal_level = level;
+}
+
+int log_level(const char *name) {
+    for (int i = 0; i <= LOG_ERROR; i++) {
+        if (!strcmp(name, LEVEL_NAMES[i])) return i;
+    }
+    return -1;
+}
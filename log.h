@@ -0,0 +1,25 @@
+// log.h --- Leveled logging that never holds up the caller
+//
+// Messages are formatted into a ring owned by the calling thread and written
+// out by a background thread, so a slow terminal never stalls the protocol
+// loop. The terminal gets at most LOG_RATE lines per second (the rest are
+// counted and skipped); a log file, if one is open, gets every message with
+// a timestamp. If a ring is full the message is dropped (and counted).
+#ifndef _LOG_H
+#define _LOG_H
+
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+#define LOG_RATE 200 // Lines per second shown on the terminal
+
+void log_msg(int level, const char *format, ...); // printf-style message
+int log_open(const char *path); // also writes every message to path, returns 0 on success
+void log_set_level(int level); // least important level shown on the terminal (default LOG_DEBUG)
+int log_level(const char *name); // level from its name ("debug", "info", "warn", "error"), -1 if unknown
+void log_flush(); // returns once everything logged so far has been written
+void log_close(); // flushes, stops the background thread and closes the log file
+
+#endif
@@ -0,0 +1,198 @@
+#include "nmr.h"
+
+#include <math.h>
+#include <string.h>
+
+// Sweep shape, in units of half the sweep width
+const double LINE_WIDTH = 0.1; // Half width of the absorption line
+const double WING_START = 0.7; // The baseline is fitted where |x| > WING_START
+
+static double sweep_x[NMR_MAX_POINTS]; // Position of each point in the sweep (-1 to 1)
+static double wing[NMR_MAX_POINTS]; // 1 on the wings, 0 under the line
+static double signal[NMR_MAX_POINTS]; // The last sweep
+static int axis_points = 0; // Sweep length sweep_x and wing were set up for
+
+#if defined(__GNUC__) && !defined(NMR_NO_SIMD)
+// Let the compiler use SIMD registers for whole groups of lanes
+#define NMR_SIMD
+typedef double vdouble __attribute__((vector_size(NMR_LANES * sizeof(double))));
+typedef uint64_t vuint __attribute__((vector_size(NMR_LANES * sizeof(uint64_t))));
+#define TO_DOUBLE(v) __builtin_convertvector(v, vdouble)
+#endif
+
+// Unaligned loads/stores of a whole group of lanes
+#define LOAD(v, p) memcpy(&(v), (p), sizeof(v))
+#define STORE(p, v) memcpy((p), &(v), sizeof(v))
+
+// Gaussian noise for every lane (Irwin-Hall sum of four xorshift uniforms)
+static void gaussian(uint64_t *state, double *out) {
+#ifdef NMR_SIMD
+    vuint s;
+    LOAD(s, state);
+    vdouble sum = {0};
+    for (int k = 0; k < 4; k++) {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        sum += TO_DOUBLE(s >> 11) * 0x1p-53;
+    }
+    STORE(state, s);
+    sum = (sum - 2.0) * sqrt(3.0);
+    STORE(out, sum);
+#else
+    for (int j = 0; j < NMR_LANES; j++) {
+        uint64_t s = state[j];
+        double sum = 0;
+        for (int k = 0; k < 4; k++) {
+            s ^= s << 13;
+            s ^= s >> 7;
+            s ^= s << 17;
+            sum += (s >> 11) * 0x1p-53;
+        }
+        state[j] = s;
+        out[j] = (sum - 2.0) * sqrt(3.0);
+    }
+#endif
+}
+
+// Sets up the frequency axis (shared by every sweep of the same length)
+static void setup_axis(int n_points) {
+    for (int i = 0; i < n_points; i++) {
+        sweep_x[i] = -1.0 + 2.0*i / (n_points - 1);
+        wing[i] = fabs(sweep_x[i]) > WING_START;
+    }
+    axis_points = n_points;
+}
+
+// Fills signal[] with one sweep
+static void synthesize(struct nmr *q, double pol, double noise) {
+    if (axis_points != q->n_points) {
+        setup_axis(q->n_points);
+    }
+    const double w2 = LINE_WIDTH * LINE_WIDTH;
+    const double *b = q->baseline;
+    for (int i = 0; i < q->n_points; i += NMR_LANES) {
+        double noise_lanes[NMR_LANES];
+        gaussian(q->rng, noise_lanes);
+#ifdef NMR_SIMD
+        vdouble x, g;
+        LOAD(x, sweep_x + i);
+        LOAD(g, noise_lanes);
+        vdouble y = pol * w2 / (x*x + w2) + b[0] + x*(b[1] + x*b[2]) + noise*g;
+        STORE(signal + i, y);
+#else
+        for (int j = 0; j < NMR_LANES; j++) {
+            double x = sweep_x[i + j];
+            signal[i + j] = pol * w2 / (x*x + w2) + b[0] + x*(b[1] + x*b[2]) + noise*noise_lanes[j];
+        }
+#endif
+    }
+}
+
+// Fits a quadratic baseline to the wings, returns the area above it
+static double integrate(const struct nmr *q) {
+    // Sums for the least squares fit: s[k] = sum(x^k), t[k] = sum(x^k * y)
+    double s[5] = {0}, t[3] = {0};
+#ifdef NMR_SIMD
+    vdouble vs[5] = {{0}}, vt[3] = {{0}}, vy = {0};
+    for (int i = 0; i < q->n_points; i += NMR_LANES) {
+        vdouble x, y, m;
+        LOAD(x, sweep_x + i);
+        LOAD(y, signal + i);
+        LOAD(m, wing + i);
+        vdouble x2 = x*x;
+        vs[0] += m;
+        vs[1] += m*x;
+        vs[2] += m*x2;
+        vs[3] += m*x2*x;
+        vs[4] += m*x2*x2;
+        vt[0] += m*y;
+        vt[1] += m*x*y;
+        vt[2] += m*x2*y;
+        vy += y;
+    }
+    double total = 0;
+    for (int j = 0; j < NMR_LANES; j++) {
+        for (int k = 0; k < 5; k++) s[k] += vs[k][j];
+        for (int k = 0; k < 3; k++) t[k] += vt[k][j];
+        total += vy[j];
+    }
+#else
+    double total = 0;
+    for (int i = 0; i < q->n_points; i++) {
+        double x = sweep_x[i], y = signal[i], m = wing[i];
+        s[0] += m;
+        s[1] += m*x;
+        s[2] += m*x*x;
+        s[3] += m*x*x*x;
+        s[4] += m*x*x*x*x;
+        t[0] += m*y;
+        t[1] += m*x*y;
+        t[2] += m*x*x*y;
+        total += y;
+    }
+#endif
+
+    // Solve the 3x3 normal equations (Cramer's rule)
+    double a[3][3] = {{s[0], s[1], s[2]}, {s[1], s[2], s[3]}, {s[2], s[3], s[4]}};
+    double det = a[0][0]*(a[1][1]*a[2][2] - a[1][2]*a[2][1])
+               - a[0][1]*(a[1][0]*a[2][2] - a[1][2]*a[2][0])
+               + a[0][2]*(a[1][0]*a[2][1] - a[1][1]*a[2][0]);
+    double c[3];
+    for (int k = 0; k < 3; k++) {
+        double m[3][3];
+        memcpy(m, a, sizeof(m));
+        for (int r = 0; r < 3; r++) m[r][k] = t[r];
+        c[k] = (m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+              - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+              + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0])) / det;
+    }
+
+    // Area between the signal and the fitted baseline
+    double base = 0;
+    for (int i = 0; i < q->n_points; i++) {
+        double x = sweep_x[i];
+        base += c[0] + x*(c[1] + x*c[2]);
+    }
+    return (total - base) * 2.0 / q->n_points;
+}
+
+void nmr_init(struct nmr *q, int n_points, uint64_t seed) {
+    if (n_points < 2*NMR_LANES) n_points = 2*NMR_LANES;
+    if (n_points > NMR_MAX_POINTS) n_points = NMR_MAX_POINTS;
+    q->n_points = (n_points + NMR_LANES - 1) / NMR_LANES * NMR_LANES;
+    memset(q->baseline, 0, sizeof(q->baseline));
+    for (int j = 0; j < NMR_LANES; j++) {
+        // splitmix64, so every lane gets a different (nonzero) stream
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        q->rng[j] = (z ^ (z >> 31)) | 1;
+    }
+
+    // Calibrate with a clean line, so a noiseless measurement is exact
+    uint64_t rng[NMR_LANES];
+    memcpy(rng, q->rng, sizeof(rng));
+    synthesize(q, 1.0, 0.0);
+    q->calib = integrate(q);
+    memcpy(q->rng, rng, sizeof(rng));
+    q->measured_pol = NAN; // Nothing measured yet
+}
+
+double nmr_sweep(struct nmr *q, double pol) {
+    // The baseline wanders a little between sweeps
+    if (q->drift > 0) {
+        double g[NMR_LANES];
+        gaussian(q->rng, g);
+        for (int k = 0; k < 3; k++) {
+            q->baseline[k] += q->drift * g[k];
+        }
+    }
+    synthesize(q, pol, q->noise);
+    q->measured_pol = integrate(q) / q->calib;
+    return q->measured_pol;
+}
+
+const double *nmr_signal() {
+    return signal;
+}
@@ -0,0 +1,30 @@
+// nmr.h --- Synthesizes the Q-meter NMR sweep the box would see, and measures it
+//
+// Each sweep is a Lorentzian absorption line (area proportional to the
+// polarization) on top of a slowly drifting quadratic baseline, plus noise.
+// The polarization is measured back the way the real system does it: fit
+// the baseline on the wings, subtract it and integrate the area.
+#ifndef _NMR_H
+#define _NMR_H
+
+#include <stdint.h>
+
+#define NMR_MAX_POINTS 1024 // Maximum number of points per sweep
+#define NMR_LANES 4 // Points processed together (the sweep length is rounded up to a multiple)
+#define NMR_DEFAULT_POINTS 400 // Points per sweep, unless the run file asks for another number
+
+struct nmr {
+    int n_points; // Points per sweep
+    double noise; // RMS noise (relative to the peak height at 100% polarization)
+    double drift; // RMS change of the baseline per sweep (same units)
+    double baseline[3]; // Baseline offset, slope and curvature
+    uint64_t rng[NMR_LANES]; // Noise generator state (one per lane)
+    double calib; // Integrated area for a polarization of 1
+    double measured_pol; // Polarization measured from the last sweep (NAN before the first)
+};
+
+void nmr_init(struct nmr *q, int n_points, uint64_t seed); // sets up the sweep (keeping the noise and drift already set)
+double nmr_sweep(struct nmr *q, double pol); // synthesizes a sweep for pol, returns the measured polarization
+const double *nmr_signal(); // the last synthesized sweep (n_points values)
+
+#endif
@@ -0,0 +1,496 @@
+#define _GNU_SOURCE // For clock_gettime, mmap and sysconf
+
+#include "parse.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PARSE_THREADS
+#endif
+
+#define MIN_CHUNK (1 << 20) // Smaller chunks are not worth a thread
+#define MAX_CHUNKS 64
+#define SAMPLE_ROWS 64 // Rows looked at to guess the column types
+#define STREAM_BUF_LEN (1 << 20) // Longest line a stream can read
+
+#if defined(__GNUC__) && !defined(PARSE_NO_SIMD)
+#define PARSE_SIMD
+#define VEC_BYTES 32
+typedef unsigned char vbytes __attribute__((vector_size(VEC_BYTES)));
+#endif
+
+struct chunk {
+    struct table *t;
+    char *begin, *end;
+    size_t first_row; // Where the chunk's rows go in the columns
+    size_t n_rows; // Upper bound after counting, actual rows after parsing
+    size_t n_bad;
+};
+
+static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Counts the newlines in [p, end), a whole vector at a time
+static size_t count_lines(const char *p, const char *end) {
+    size_t n = 0;
+#ifdef PARSE_SIMD
+    while (end - p >= VEC_BYTES * 255) {
+        // Per-lane counters, summed before they can overflow
+        vbytes counts = {0};
+        for (int i = 0; i < 255; i++, p += VEC_BYTES) {
+            vbytes v;
+            memcpy(&v, p, VEC_BYTES);
+            counts -= (vbytes)(v == '\n');
+        }
+        for (int i = 0; i < VEC_BYTES; i++) {
+            n += counts[i];
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        n += *p == '\n';
+    }
+    return n;
+}
+
+// Parses [p, end) as a number, returns false if it is not one. Numbers with
+// up to 19 digits and small exponents (everything the simulation writes) take
+// the exact fast path; anything else goes through strtod.
+static bool parse_number(const char *p, const char *end, double *out) {
+    const char *start = p;
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p++ == '-';
+    }
+    uint64_t mant = 0;
+    int n_digits = 0, exp10 = 0;
+    bool any = false, truncated = false;
+    for (; p < end && (unsigned)(*p - '0') < 10; p++, any = true) {
+        if (n_digits < 19) {
+            mant = mant*10 + (*p - '0');
+            n_digits += mant != 0;
+        } else {
+            exp10++;
+            truncated = true;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && (unsigned)(*p - '0') < 10; p++, any = true) {
+            if (n_digits < 19) {
+                mant = mant*10 + (*p - '0');
+                n_digits += mant != 0;
+                exp10--;
+            } else {
+                truncated = true;
+            }
+        }
+    }
+    if (!any) return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        bool exp_neg = false, exp_any = false;
+        int e = 0;
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_neg = *p++ == '-';
+        }
+        for (; p < end && (unsigned)(*p - '0') < 10; p++, exp_any = true) {
+            if (e < 10000) e = e*10 + (*p - '0');
+        }
+        if (!exp_any) return false;
+        exp10 += exp_neg ? -e : e;
+    }
+    if (p != end) return false;
+
+    if (!truncated && mant < (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+        // Both operands are exact, so this single operation rounds correctly
+        double v = (double)mant;
+        v = exp10 < 0 ? v / POW10[-exp10] : v * POW10[exp10];
+        *out = neg ? -v : v;
+    } else {
+        char tmp[64];
+        size_t len = end - start < (long)sizeof(tmp) ? (size_t)(end - start) : sizeof(tmp) - 1;
+        memcpy(tmp, start, len);
+        tmp[len] = '\0';
+        *out = strtod(tmp, NULL);
+    }
+    return true;
+}
+
+// Finds the next field of a line, returns false at the end of the line.
+// Quoted CSV fields may contain commas (but not newlines).
+static bool next_field(char delim, char **p, char *end, char **field, char **field_end) {
+    char *s = *p;
+    if (delim) {
+        if (s > end) return false;
+        while (s < end && (*s == ' ' || *s == '\t')) s++;
+        char *e;
+        if (s < end && *s == '"') {
+            s++;
+            e = s;
+            while (e < end && *e != '"') e++;
+            *field = s;
+            *field_end = e;
+            while (e < end && *e != delim) e++;
+        } else {
+            e = s;
+            while (e < end && *e != delim) e++;
+            *field = s;
+            *field_end = e;
+            while (*field_end > s && ((*field_end)[-1] == ' ' || (*field_end)[-1] == '\t' || (*field_end)[-1] == '\r')) {
+                (*field_end)--;
+            }
+        }
+        *p = e + 1; // Past the delimiter (or past the end, so the next call stops)
+        return true;
+    }
+    while (s < end && (*s == ' ' || *s == '\t' || *s == '\r')) s++;
+    if (s == end) return false;
+    char *e = s;
+    while (e < end && *e != ' ' && *e != '\t' && *e != '\r') e++;
+    *field = s;
+    *field_end = e;
+    *p = e < end ? e + 1 : e; // Past the separator, which may get overwritten
+    return true;
+}
+
+static bool blank_line(const char *p, const char *end) {
+    for (; p < end; p++) {
+        if (*p != ' ' && *p != '\t' && *p != '\r') return false;
+    }
+    return true;
+}
+
+// Parses one (non-blank) line, returns the number of bad fields
+static int parse_row(const struct table *t, char *line, char *eol, double *num, const char **text) {
+    char *p = line, *f, *f_end;
+    int col = 0, n_bad = 0;
+    for (; col < t->n_cols && next_field(t->delim, &p, eol, &f, &f_end); col++) {
+        if (t->type[col] == PARSE_NUMBER) {
+            if (!parse_number(f, f_end, &num[col])) {
+                num[col] = NAN;
+                n_bad += f_end > f && strncmp(f, "N/A", 3);
+            }
+        } else {
+            *f_end = '\0'; // The buffer is private to the reader
+            text[col] = f;
+            num[col] = NAN;
+        }
+    }
+    for (; col < t->n_cols; col++) {
+        num[col] = NAN;
+        text[col] = "";
+    }
+    return n_bad;
+}
+
+// Parses the rows of a chunk into the columns
+static void *parse_chunk(void *arg) {
+    struct chunk *c = arg;
+    struct table *t = c->t;
+    size_t row = c->first_row;
+    for (char *line = c->begin; line < c->end; ) {
+        char *eol = memchr(line, '\n', c->end - line);
+        if (!eol) eol = c->end;
+        if (!blank_line(line, eol)) {
+            double num[PARSE_MAX_COLS];
+            const char *text[PARSE_MAX_COLS];
+            c->n_bad += parse_row(t, line, eol, num, text);
+            for (int col = 0; col < t->n_cols; col++) {
+                if (t->type[col] == PARSE_NUMBER) {
+                    t->num[col][row] = num[col];
+                } else {
+                    t->text[col][row] = text[col];
+                }
+            }
+            row++;
+        }
+        line = eol + 1;
+    }
+    c->n_rows = row - c->first_row;
+    return NULL;
+}
+
+// Splits the first non-blank line into fields, returns the number of fields
+static int split_line(char delim, char **p, char *end, char **fields, char **fields_end, int max) {
+    char *line = *p;
+    char *eol;
+    do {
+        line = *p;
+        eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        *p = eol < end ? eol + 1 : end;
+    } while (line < end && blank_line(line, eol));
+    int n = 0;
+    char *q = line;
+    while (n < max && line < end && next_field(delim, &q, eol, &fields[n], &fields_end[n])) {
+        n++;
+    }
+    return n;
+}
+
+static bool na_field(const char *f, const char *f_end) {
+    return f == f_end || (f_end - f == 3 && !strncmp(f, "N/A", 3));
+}
+
+// Reads the header (if there is one) and guesses the column types, returns
+// where the data starts
+static char *read_layout(struct table *t, char *begin, char *end) {
+    char *fields[PARSE_MAX_COLS], *fields_end[PARSE_MAX_COLS];
+    char *eol = memchr(begin, '\n', end - begin);
+    t->delim = memchr(begin, ',', (eol ? eol : end) - begin) ? ',' : 0;
+
+    char *p = begin;
+    int n = split_line(t->delim, &p, end, fields, fields_end, PARSE_MAX_COLS);
+    bool header = false;
+    for (int i = 0; i < n; i++) {
+        double v;
+        header |= !na_field(fields[i], fields_end[i]) && !parse_number(fields[i], fields_end[i], &v);
+    }
+    t->n_cols = n;
+    for (int i = 0; i < n; i++) {
+        if (header) {
+            size_t len = fields_end[i] - fields[i];
+            if (len >= PARSE_NAME_LEN) len = PARSE_NAME_LEN - 1;
+            memcpy(t->name[i], fields[i], len);
+            t->name[i][len] = '\0';
+        } else {
+            sprintf(t->name[i], "%d", i + 1);
+        }
+        t->type[i] = PARSE_NUMBER;
+    }
+    char *data = header ? p : begin;
+
+    // A column is text if any of the sampled fields is not a number
+    p = data;
+    for (int r = 0; r < SAMPLE_ROWS && p < end; r++) {
+        int m = split_line(t->delim, &p, end, fields, fields_end, t->n_cols);
+        for (int i = 0; i < m; i++) {
+            double v;
+            if (!na_field(fields[i], fields_end[i]) && !parse_number(fields[i], fields_end[i], &v)) {
+                t->type[i] = PARSE_TEXT;
+            }
+        }
+    }
+    return data;
+}
+
+static double wall_time() {
+#ifdef PARSE_THREADS
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Loads the file into a private, writable buffer, with room to terminate
+// the last field
+static int load(struct table *t, const char *path) {
+#ifdef PARSE_THREADS
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return 1;
+    }
+    t->len = st.st_size;
+    if (t->len == 0) {
+        close(fd);
+        return 0;
+    }
+    t->buf = mmap(NULL, t->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (t->buf == MAP_FAILED) {
+        t->buf = NULL;
+        return 1;
+    }
+    if (t->buf[t->len - 1] == '\n') {
+        madvise(t->buf, t->len, MADV_SEQUENTIAL);
+        t->mapped = 1;
+        return 0;
+    }
+    // No final newline, so no spare byte after the last field: read it instead
+    munmap(t->buf, t->len);
+    t->buf = NULL;
+#endif
+    FILE *f = fopen(path, "rb");
+    if (!f) return 1;
+    fseek(f, 0, SEEK_END);
+    t->len = ftell(f);
+    rewind(f);
+    t->buf = malloc(t->len + 1);
+    if (!t->buf) {
+        fclose(f);
+        return 1;
+    }
+    t->len = fread(t->buf, 1, t->len, f);
+    fclose(f);
+    return 0;
+}
+
+int parse_file(struct table *t, const char *path, int n_threads) {
+    memset(t, 0, sizeof(*t));
+    double start = wall_time();
+    if (load(t, path)) return 1;
+    if (!t->buf) return 0; // Empty file
+    char *end = t->buf + t->len;
+    char *data = read_layout(t, t->buf, end);
+
+    // Cut the data into chunks at line boundaries
+#ifdef PARSE_THREADS
+    if (n_threads <= 0) n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    size_t n_chunks = (end - data) / MIN_CHUNK + 1;
+    if (n_threads > 0 && n_chunks > (size_t)n_threads) n_chunks = n_threads;
+    if (n_chunks > MAX_CHUNKS) n_chunks = MAX_CHUNKS;
+    struct chunk chunks[MAX_CHUNKS];
+    char *p = data;
+    for (size_t i = 0; i < n_chunks; i++) {
+        chunks[i].t = t;
+        chunks[i].begin = p;
+        p = i + 1 == n_chunks ? end : data + (end - data) * (i + 1) / n_chunks;
+        if (p < chunks[i].begin) p = chunks[i].begin;
+        char *eol = memchr(p, '\n', end - p);
+        p = eol ? eol + 1 : end;
+        chunks[i].end = p;
+        chunks[i].n_bad = 0;
+    }
+
+    // Every line is at most one row, so the rows of each chunk can go
+    // straight to their own part of the columns and be packed afterwards
+    size_t capacity = 0;
+    for (size_t i = 0; i < n_chunks; i++) {
+        chunks[i].first_row = capacity;
+        capacity += count_lines(chunks[i].begin, chunks[i].end) + 1;
+    }
+    for (int c = 0; c < t->n_cols; c++) {
+        if (t->type[c] == PARSE_NUMBER) {
+            t->num[c] = malloc(capacity * sizeof(double));
+        } else {
+            t->text[c] = malloc(capacity * sizeof(char *));
+        }
+        if (!t->num[c] && !t->text[c]) {
+            parse_free(t);
+            return 1;
+        }
+    }
+
+#ifdef PARSE_THREADS
+    pthread_t threads[MAX_CHUNKS];
+    size_t n_started = 0;
+    for (size_t i = 1; i < n_chunks; i++, n_started++) {
+        if (pthread_create(&threads[i], NULL, parse_chunk, &chunks[i])) break;
+    }
+    parse_chunk(&chunks[0]);
+    for (size_t i = 1; i <= n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = n_started + 1; i < n_chunks; i++) {
+        parse_chunk(&chunks[i]); // Could not get a thread
+    }
+#else
+    for (size_t i = 0; i < n_chunks; i++) {
+        parse_chunk(&chunks[i]);
+    }
+#endif
+
+    // Pack the rows
+    for (size_t i = 0; i < n_chunks; i++) {
+        for (int c = 0; c < t->n_cols; c++) {
+            if (t->type[c] == PARSE_NUMBER) {
+                memmove(t->num[c] + t->n_rows, t->num[c] + chunks[i].first_row, chunks[i].n_rows * sizeof(double));
+            } else {
+                memmove(t->text[c] + t->n_rows, t->text[c] + chunks[i].first_row, chunks[i].n_rows * sizeof(char *));
+            }
+        }
+        t->n_rows += chunks[i].n_rows;
+        t->n_bad += chunks[i].n_bad;
+    }
+    t->seconds = wall_time() - start;
+    return 0;
+}
+
+void parse_free(struct table *t) {
+    for (int c = 0; c < t->n_cols; c++) {
+        free(t->num[c]);
+        free(t->text[c]);
+    }
+#ifdef PARSE_THREADS
+    if (t->mapped) munmap(t->buf, t->len);
+#endif
+    if (!t->mapped) free(t->buf);
+    memset(t, 0, sizeof(*t));
+}
+
+int parse_column(const struct table *t, const char *name) {
+    for (int c = 0; c < t->n_cols; c++) {
+        if (!strcmp(t->name[c], name)) return c;
+    }
+    return -1;
+}
+
+// Moves the unread part to the front of the buffer and reads more after it
+// (keeping a spare byte to terminate the last field)
+static size_t refill(struct parse_stream *s) {
+    memmove(s->buf, s->buf + s->start, s->fill - s->start);
+    s->fill -= s->start;
+    s->start = 0;
+    size_t got = fread(s->buf + s->fill, 1, STREAM_BUF_LEN - 1 - s->fill, s->f);
+    s->fill += got;
+    return got;
+}
+
+int parse_open(struct parse_stream *s, const char *path) {
+    memset(s, 0, sizeof(*s));
+    s->f = fopen(path, "rb");
+    if (!s->f) return 1;
+    s->buf = malloc(STREAM_BUF_LEN);
+    if (!s->buf) {
+        fclose(s->f);
+        return 1;
+    }
+    refill(s);
+    s->start = read_layout(&s->layout, s->buf, s->buf + s->fill) - s->buf;
+    return 0;
+}
+
+int parse_next(struct parse_stream *s) {
+    for (;;) {
+        char *line = s->buf + s->start, *end = s->buf + s->fill;
+        char *eol = memchr(line, '\n', end - line);
+        if (!eol) {
+            if (!s->eof && (s->start > 0 || s->fill < STREAM_BUF_LEN - 1)) {
+                s->eof = !refill(s);
+                continue;
+            }
+            if (line == end) return 0;
+            eol = end; // Last line without a newline (or a line longer than the buffer)
+        }
+        s->start = eol - s->buf + (eol < end);
+        if (!blank_line(line, eol)) {
+            s->layout.n_bad += parse_row(&s->layout, line, eol, s->num, s->text);
+            return 1;
+        }
+    }
+}
+
+void parse_close(struct parse_stream *s) {
+    if (s->f) fclose(s->f);
+    free(s->buf);
+    memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,54 @@
+// parse.h --- Fast parser for simulation outputs and experiment logs
+//
+// Reads whitespace-separated files (.dat/.txt outputs) and CSV logs (like
+// events3.csv) into typed columns. The file is split into chunks at line
+// boundaries and the chunks are parsed in parallel. Files too big to keep
+// can be streamed a row at a time instead.
+#ifndef _PARSE_H
+#define _PARSE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define PARSE_MAX_COLS 32
+#define PARSE_NAME_LEN 32
+
+// Column types (guessed from the first rows of the file)
+#define PARSE_NUMBER 0 // doubles (NaN where a field is missing or not a number, e.g. "N/A")
+#define PARSE_TEXT 1 // strings
+
+struct table {
+    int n_cols;
+    size_t n_rows;
+    char name[PARSE_MAX_COLS][PARSE_NAME_LEN]; // From the header line, or "1", "2", ... without one
+    int type[PARSE_MAX_COLS];
+    double *num[PARSE_MAX_COLS]; // PARSE_NUMBER columns
+    const char **text[PARSE_MAX_COLS]; // PARSE_TEXT columns (pointing into the file buffer)
+    size_t n_bad; // Fields of number columns that held something else
+    double seconds; // Wall time taken to parse
+    // File buffer
+    char *buf;
+    size_t len;
+    int mapped;
+    char delim; // ',' for CSV, 0 for whitespace
+};
+
+// Reads a file a row at a time (in a fixed-size buffer)
+struct parse_stream {
+    struct table layout; // Column names and types (no rows)
+    FILE *f;
+    char *buf;
+    size_t start, fill; // Unread part of the buffer
+    int eof;
+    double num[PARSE_MAX_COLS]; // The current row (NaN in text columns)
+    const char *text[PARSE_MAX_COLS]; // (valid until the next row is read)
+};
+
+int parse_file(struct table *t, const char *path, int n_threads); // 0 threads == one per CPU, returns 0 on success
+void parse_free(struct table *t); // releases the columns and the file buffer
+int parse_column(const struct table *t, const char *name); // index of a named column, or -1
+int parse_open(struct parse_stream *s, const char *path); // reads the header and column types, returns 0 on success
+int parse_next(struct parse_stream *s); // reads the next row, returns 0 at the end
+void parse_close(struct parse_stream *s);
+
+#endif
@@ -0,0 +1,238 @@
+#include "record.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define REC_MAGIC "PTSIMREC"
+#define REC_VERSION 2 // Bump whenever struct sim_state (sim.c) changes: snapshots are stored as is
+
+// Event types
+#define EV_SEED 1 // Payload: uint32_t seed
+#define EV_LINE 2 // Payload: run file line (not terminated)
+#define EV_RX 3 // Payload: bytes received from the box
+#define EV_TICK 4 // No payload
+#define EV_CLOCK 5 // Payload: int64_t seconds since the epoch
+#define EV_SNAPSHOT 6 // Payload: struct snapshot_header, then the engine state
+
+#define MAX_PAYLOAD 65535
+
+struct event_header {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t len; // Payload length
+};
+
+struct snapshot_header {
+    double time; // Simulation time of the snapshot
+    int64_t line_offset; // Where the run file line being executed was recorded
+};
+
+int record_mode = REC_OFF;
+static FILE *rec_file;
+
+// Received bytes are collected into one event until something else happens
+static uint8_t rx_buf[MAX_PAYLOAD];
+static size_t rx_len = 0;
+
+// Replay: the event currently being consumed
+static struct event_header ev;
+static uint8_t ev_payload[MAX_PAYLOAD];
+static size_t ev_pos; // Bytes of the payload already consumed
+static bool ev_valid = false;
+
+static long last_line_offset = 0; // Recording: where the last run file line was written
+static long jump_offset = 0; // Replay: where to continue after the next line (0 == don't jump)
+
+static void write_event(int type, const void *payload, size_t len) {
+    struct event_header h = {type, 0, len};
+    fwrite(&h, sizeof(h), 1, rec_file);
+    if (len) {
+        fwrite(payload, 1, len, rec_file);
+    }
+}
+
+static void flush_rx() {
+    if (rx_len) {
+        write_event(EV_RX, rx_buf, rx_len);
+        rx_len = 0;
+    }
+}
+
+static void record_event(int type, const void *payload, size_t len) {
+    flush_rx();
+    write_event(type, payload, len);
+}
+
+// Makes sure ev holds an unconsumed event (returns false at the end of the recording)
+static bool peek_event() {
+    if (ev_valid && (ev.type != EV_RX || ev_pos < ev.len)) {
+        return true;
+    }
+    do {
+        ev_valid = fread(&ev, sizeof(ev), 1, rec_file) == 1 && fread(ev_payload, 1, ev.len, rec_file) == ev.len;
+    } while (ev_valid && ev.type == EV_SNAPSHOT); // Snapshots are only used for seeking
+    ev_pos = 0;
+    return ev_valid;
+}
+
+// Consumes the next event if it has the given type
+static bool take_event(int type) {
+    if (!peek_event() || ev.type != type) {
+        return false;
+    }
+    ev_valid = false;
+    return true;
+}
+
+int record_open(const char *path) {
+    rec_file = fopen(path, "wb");
+    if (!rec_file) return 1;
+    uint32_t version = REC_VERSION;
+    fwrite(REC_MAGIC, 1, 8, rec_file);
+    fwrite(&version, sizeof(version), 1, rec_file);
+    record_mode = REC_RECORDING;
+    return 0;
+}
+
+int replay_open(const char *path) {
+    rec_file = fopen(path, "rb");
+    if (!rec_file) return 1;
+    char magic[8];
+    uint32_t version;
+    if (fread(magic, 1, 8, rec_file) != 8 || memcmp(magic, REC_MAGIC, 8)
+        || fread(&version, sizeof(version), 1, rec_file) != 1 || version != REC_VERSION) {
+        fclose(rec_file);
+        return 1;
+    }
+    record_mode = REC_REPLAYING;
+    ev_valid = false;
+    return 0;
+}
+
+void record_close() {
+    if (record_mode == REC_OFF) return;
+    if (record_mode == REC_RECORDING) {
+        flush_rx();
+    }
+    fclose(rec_file);
+    record_mode = REC_OFF;
+}
+
+uint32_t record_seed(uint32_t seed) {
+    if (record_mode == REC_RECORDING) {
+        record_event(EV_SEED, &seed, sizeof(seed));
+    } else if (record_mode == REC_REPLAYING && peek_event() && ev.type == EV_SEED) {
+        memcpy(&seed, ev_payload, sizeof(seed));
+        take_event(EV_SEED);
+    }
+    return seed;
+}
+
+int64_t record_clock(int64_t now) {
+    if (record_mode == REC_RECORDING) {
+        record_event(EV_CLOCK, &now, sizeof(now));
+    } else if (record_mode == REC_REPLAYING && peek_event() && ev.type == EV_CLOCK) {
+        memcpy(&now, ev_payload, sizeof(now));
+        take_event(EV_CLOCK);
+    }
+    return now;
+}
+
+void record_line(const char *line) {
+    if (record_mode == REC_RECORDING) {
+        size_t len = strlen(line);
+        flush_rx();
+        last_line_offset = ftell(rec_file);
+        record_event(EV_LINE, line, len < MAX_PAYLOAD ? len : MAX_PAYLOAD);
+    }
+}
+
+int replay_line(char *buf, size_t len) {
+    if (!peek_event() || ev.type != EV_LINE) {
+        return 0;
+    }
+    size_t n = ev.len < len - 1 ? ev.len : len - 1;
+    memcpy(buf, ev_payload, n);
+    buf[n] = '\0';
+    take_event(EV_LINE);
+    if (jump_offset) {
+        // This is the line that was running when the snapshot we seeked to was
+        // taken, so carry on from the snapshot rather than the start of the line
+        fseek(rec_file, jump_offset, SEEK_SET);
+        jump_offset = 0;
+        ev_valid = false;
+    }
+    return 1;
+}
+
+void record_rx(uint8_t byte) {
+    if (record_mode == REC_RECORDING) {
+        if (rx_len == MAX_PAYLOAD) {
+            flush_rx();
+        }
+        rx_buf[rx_len++] = byte;
+    }
+}
+
+bool replay_rx(uint8_t *byte) {
+    if (!peek_event() || ev.type != EV_RX) {
+        return false;
+    }
+    *byte = ev_payload[ev_pos++];
+    return true;
+}
+
+void record_tick() {
+    if (record_mode == REC_RECORDING) {
+        record_event(EV_TICK, NULL, 0);
+        // Live sessions usually end with Ctrl-C, so don't keep much unwritten
+        fflush(rec_file);
+    }
+}
+
+bool replay_tick() {
+    return take_event(EV_TICK);
+}
+
+void record_snapshot(double time, const void *state, size_t len) {
+    if (record_mode != REC_RECORDING || len + sizeof(struct snapshot_header) > MAX_PAYLOAD) {
+        return;
+    }
+    struct snapshot_header sh = {time, last_line_offset};
+    uint8_t payload[MAX_PAYLOAD];
+    memcpy(payload, &sh, sizeof(sh));
+    memcpy(payload + sizeof(sh), state, len);
+    record_event(EV_SNAPSHOT, payload, sizeof(sh) + len);
+}
+
+int replay_seek(double time, void *state, size_t len) {
+    if (record_mode != REC_REPLAYING) return 1;
+    long start = ftell(rec_file);
+
+    // Only the snapshots' payloads need to be read, everything else is skipped over
+    long found_end = 0;
+    struct snapshot_header found;
+    struct event_header h;
+    while (fread(&h, sizeof(h), 1, rec_file) == 1) {
+        if (h.type != EV_SNAPSHOT) {
+            if (fseek(rec_file, h.len, SEEK_CUR)) break;
+            continue;
+        }
+        struct snapshot_header sh;
+        if (h.len != sizeof(sh) + len || fread(&sh, sizeof(sh), 1, rec_file) != 1) break;
+        if (sh.time > time) break; // Snapshots are in time order
+        if (fread(state, 1, len, rec_file) != len) break;
+        found = sh;
+        found_end = ftell(rec_file);
+    }
+
+    if (!found_end) {
+        fseek(rec_file, start, SEEK_SET);
+        return 1;
+    }
+    // Continue from the line that was running, then jump to the snapshot
+    fseek(rec_file, found.line_offset, SEEK_SET);
+    jump_offset = found_end;
+    ev_valid = false;
+    return 0;
+}
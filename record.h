@@ -0,0 +1,36 @@
+// record.h --- Records every external input of a run, so it can be replayed exactly
+//
+// A recording is a sequence of events: the random seed, each run file line,
+// bytes received from the box, simulation ticks and wall-clock readings.
+// When replaying, the same values are handed back in the same order (and
+// ticks happen as fast as possible instead of waiting for real time).
+// Periodic snapshots of the engine state let a replay start part way through.
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REC_OFF 0
+#define REC_RECORDING 1
+#define REC_REPLAYING 2
+
+extern int record_mode; // One of the REC_* modes
+
+int record_open(const char *path); // starts recording into path, returns 0 on success
+int replay_open(const char *path); // starts replaying from path, returns 0 on success
+void record_close(); // finishes recording/replaying
+
+uint32_t record_seed(uint32_t seed); // records the seed (or returns the recorded one when replaying)
+int64_t record_clock(int64_t now); // records a wall-clock reading (or returns the recorded one)
+void record_line(const char *line); // records a run file line
+int replay_line(char *buf, size_t len); // gets the next recorded run file line, returns 0 at the end
+void record_rx(uint8_t byte); // records a byte received from the box
+bool replay_rx(uint8_t *byte); // gets the next received byte, false if none arrived before the next tick
+void record_tick(); // records a simulation tick (serial mode)
+bool replay_tick(); // whether the next recorded event is a tick (consumes it)
+void record_snapshot(double time, const void *state, size_t len); // records a snapshot of the engine state
+int replay_seek(double time, void *state, size_t len); // jumps to the last snapshot at or before time, returns 0 if there was one
+
+#endif
@@ -0,0 +1,92 @@
+#include "rotate.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "uring.h"
+
+static void segment_path(const struct rotation *r, int segment, char *path) {
+    snprintf(path, ROTATE_PATH_LEN + 16, "%s.%03d.dat", r->base, segment);
+}
+
+// Closes the current segment and lists it in the manifest
+static int finish_segment(struct rotation *r) {
+    if (!r->out) return 0;
+    int failed = fclose(r->out) != 0;
+    r->out = NULL;
+    char path[ROTATE_PATH_LEN + 16];
+    segment_path(r, r->segment, path);
+    // Only the file name, the manifest sits next to the segments
+    const char *name = strrchr(path, '/');
+    fprintf(r->manifest, "%s %6lf %6lf %lu %llu\n", name ? name + 1 : path, r->first_time, r->last_time, r->rows, r->bytes);
+    fflush(r->manifest);
+    r->segment++;
+    return failed;
+}
+
+static int start_segment(struct rotation *r, double time) {
+    char path[ROTATE_PATH_LEN + 16];
+    segment_path(r, r->segment, path);
+    r->out = uring_on ? uring_fopen(path, "w") : fopen(path, "w");
+    if (!r->out) {
+        printf("Could not open output segment: %s\n", path);
+        return 1;
+    }
+    if (r->period > 0) {
+        r->start = floor(time / r->period) * r->period;
+    }
+    r->first_time = time;
+    r->rows = 0;
+    r->bytes = 0;
+    return 0;
+}
+
+int rotate_open(struct rotation *r, const char *base, double period, unsigned long long max_bytes) {
+    // Rotating the same output again carries on after its last segment
+    char same[ROTATE_PATH_LEN];
+    snprintf(same, sizeof(same), "%s", base);
+    int segment = r->segment > 0 && !strcmp(r->base, same) ? r->segment : 0;
+    memset(r, 0, sizeof(*r));
+    snprintf(r->base, ROTATE_PATH_LEN, "%s", base);
+    r->period = period;
+    r->max_bytes = max_bytes;
+    r->segment = segment;
+    char path[ROTATE_PATH_LEN + 16];
+    snprintf(path, sizeof(path), "%s.manifest", r->base);
+    r->manifest = fopen(path, segment ? "a" : "w");
+    if (!r->manifest) return 1;
+    if (!segment) {
+        fputs("# segment first_time last_time rows bytes\n", r->manifest);
+        fflush(r->manifest);
+    }
+    return 0;
+}
+
+int rotate_write(struct rotation *r, double time, const char *row, size_t len) {
+    if (r->out) {
+        bool new_period = r->period > 0 && time >= r->start + r->period;
+        bool full = r->max_bytes > 0 && r->bytes + len > r->max_bytes;
+        if (new_period || full) {
+            finish_segment(r);
+        }
+    }
+    if (!r->out && start_segment(r, time)) {
+        return 1;
+    }
+    if (fwrite(row, 1, len, r->out) != len) {
+        return 1;
+    }
+    r->last_time = time;
+    r->rows++;
+    r->bytes += len;
+    return 0;
+}
+
+void rotate_close(struct rotation *r) {
+    if (!r->manifest) return;
+    if (finish_segment(r)) {
+        puts("Could not write all of the last output segment");
+    }
+    fclose(r->manifest);
+    r->manifest = NULL;
+}
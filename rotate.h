@@ -0,0 +1,36 @@
+// rotate.h --- Splits a long output into segments, listed in a manifest
+//
+// Rows go to base.000.dat, base.001.dat, ... A new segment starts at every
+// multiple of the period in simulated time (so each segment covers e.g.
+// one hour) or when the current one reaches the size limit, whichever
+// comes first. When a segment is finished, a line is added to
+// base.manifest: its file name, first and last time, rows and bytes.
+// Once a segment is in the manifest it won't be written again, so it can
+// be compressed or shipped while the run carries on. Opening the same base
+// again (after rotate_close) numbers on from the last segment and adds to
+// the manifest; clear the struct to start a new one.
+#ifndef _ROTATE_H
+#define _ROTATE_H
+
+#include <stdio.h>
+
+#define ROTATE_PATH_LEN 256
+
+struct rotation {
+    char base[ROTATE_PATH_LEN]; // Output path without the .dat
+    double period; // Simulated seconds per segment (0 == no limit)
+    unsigned long long max_bytes; // Size limit of a segment (0 == no limit)
+    FILE *out; // Current segment (NULL until the first row)
+    FILE *manifest;
+    int segment; // Number of the current segment
+    double start; // Start of the current period
+    double first_time, last_time; // Times of the segment's rows
+    unsigned long rows;
+    unsigned long long bytes;
+};
+
+int rotate_open(struct rotation *r, const char *base, double period, unsigned long long max_bytes); // returns 0 on success
+int rotate_write(struct rotation *r, double time, const char *row, size_t len); // writes a row (with its newline), returns 0 on success
+void rotate_close(struct rotation *r); // finishes the last segment and the manifest
+
+#endif
@@ -10,6 +10,26 @@ FILE *script_file;
 #define CMD_BUFLEN 40
 
 static char commands[MAX_CMDS][CMD_BUFLEN];
+static int n_tokens = 0; // Number of tokens (command and arguments) on the current line
+static const char *script_string = NULL; // Line being parsed by script_parse (instead of the file)
+
+// Next character of the script (from the file or from script_parse's line)
+static int script_getc() {
+    if (script_string) {
+        return *script_string ? *script_string++ : EOF;
+    }
+    return fgetc(script_file);
+}
+
+// Finishes the current line: terminates the last token and clears stale ones
+static int end_line(int cmd, int pos, int read) {
+    commands[cmd][pos] = 0;
+    n_tokens = pos ? cmd + 1 : cmd;
+    for (int i = cmd + 1; i < MAX_CMDS; i++) {
+        commands[i][0] = 0;
+    }
+    return read;
+}
 
 int script_fopen(char *filename) {
     script_file = fopen(filename, "r");
@@ -21,29 +41,26 @@ int script_readline() {
     int cmd = 0;
     int pos = 0;
     while (true) {
-        char c = fgetc(script_file);
+        int c = script_getc();
         if (c == EOF) {
-            commands[cmd][pos] = 0;
-            return read;
+            return end_line(cmd, pos, read);
         } else if (c == '\n' || c == '\r') {
             if (cmd == 0 && pos == 0) {
                 continue;
             } else {
                 // Make sure to null-terminate the string
-                commands[cmd][pos] = 0;
-                return read;
+                return end_line(cmd, pos, read);
             }
         } else if (c == '#') {
             // Comment
             if (cmd == 0 && pos == 0) {
                 // Skip to next line
-                do {
-                    c = fgetc(script_file);
-                } while (c != '\n');
+                do {
+                    c = script_getc();
+                } while (c != '\n' && c != EOF);
                 continue;
-            } else {
-                commands[cmd][pos] = 0;
-                return read;
+            } else {
+                return end_line(cmd, pos, read);
             }
         } else if (c == ' ' || c == '\t') {
             if (cmd == 0 && pos == 0) {
@@ -61,12 +78,27 @@ int script_readline() {
                 commands[cmd++][pos] = 0;
                 pos = 0;
             } else {
-                return read;
+                return end_line(cmd, pos, read);
             }
         }
     }
 }
 
+int script_parse(const char *line) {
+    script_string = line;
+    int read = script_readline();
+    script_string = NULL;
+    return read;
+}
+
+void script_getline(char *buf, size_t len) {
+    size_t pos = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < n_tokens && pos + 1 < len; i++) {
+        pos += snprintf(buf + pos, len - pos, i ? " %s" : "%s", commands[i]);
+    }
+}
+
 bool script_cmdequ(char *command) {
     return strcmp(commands[0], command) == 0;
 }
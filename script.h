@@ -3,9 +3,12 @@
 #define _SCRIPT_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 int script_fopen(char *filename); // returns 0 on success
 int script_readline(); // returns number of characters (in command or argument)
+int script_parse(const char *line); // makes line the current line (as if it were read from the file)
+void script_getline(char *buf, size_t len); // writes the current line (tokens separated by spaces) into buf
 bool script_cmdequ(char *command); // whether the command of the line is *command*
 char *script_getarg(int n); // returns an argument
 void script_fclose(); // closes the file
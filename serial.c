@@ -2,9 +2,20 @@
 
 #include <stdlib.h>
 
+#include "record.h"
 #include "rs232.h"
+#include "uring.h"
+
+#ifdef __linux__
+extern int Cport[]; // Descriptors of the open ports (rs232.c)
+#endif
 
 void serial_start(int port) {
+    if (record_mode == REC_REPLAYING) {
+        // Everything the box sent is in the recording
+        puts("Replaying serial input");
+        return;
+    }
     // Start serial stuff
     puts("Closing port...");
     RS232_CloseComport(port);
@@ -16,28 +27,87 @@ void serial_start(int port) {
         getchar();
         exit(1);
     }
+#ifdef __linux__
+    if (uring_on && uring_serial_attach(Cport[port])) {
+        puts("Could not attach the port to io_uring, using plain reads and writes");
+    }
+#endif
+}
+
+// Receives up to one byte, waiting for it if asked to
+static int poll_port(int port, uint8_t *byte, bool wait) {
+    if (impair_on) {
+        return impair_read(byte, wait);
+    }
+    if (uring_serial_attached()) {
+        return uring_serial_read(byte, 1, wait);
+    }
+    int got;
+    do {
+        got = RS232_PollComport(port, byte, 1);
+    } while (wait && got <= 0);
+    return got;
+}
+
+static void send_port(int port, uint8_t value) {
+    if (uring_serial_attached()) {
+        uring_serial_write(&value, 1);
+    } else {
+        RS232_SendByte(port, value);
+    }
+}
+
+// The port at each end of the emulated line
+static int impaired_port;
+
+static int impaired_read(uint8_t *byte) {
+    if (uring_serial_attached()) {
+        return uring_serial_read(byte, 1, false) > 0;
+    }
+    return RS232_PollComport(impaired_port, byte, 1) > 0;
+}
+
+static void impaired_write(uint8_t value) {
+    send_port(impaired_port, value);
+}
+
+int serial_impair(int port, const struct impair_params *params) {
+    impaired_port = port;
+    return impair_start(params, impaired_read, impaired_write);
 }
 
 uint8_t serial_rx_byte(int port) {
     uint8_t ret;
-    int got = RS232_PollComport(port, &ret, 1);
+    if (record_mode == REC_REPLAYING) {
+        return replay_rx(&ret) ? ret : 0;
+    }
+    int got = poll_port(port, &ret, false);
+    if (got > 0) {
+        record_rx(ret);
+    }
 
-    return got ? ret : 0;
+    return got > 0 ? ret : 0;
 }
 
 uint8_t serial_rx_byte_wait(int port) {
     uint8_t ret;
-    int got;
+    if (record_mode == REC_REPLAYING) {
+        return replay_rx(&ret) ? ret : 0;
+    }
 
-    do {
-        got = RS232_PollComport(port, &ret, 1);
-    } while (!got);
+    poll_port(port, &ret, true);
+    record_rx(ret);
 
     return ret;
 }
 
 void serial_tx_byte(int port, uint8_t value) {
-    RS232_SendByte(port, value);
+    if (record_mode == REC_REPLAYING) return; // Nobody to send to
+    if (impair_on) {
+        impair_write(value);
+    } else {
+        send_port(port, value);
+    }
 }
 
 // Reads a floating point number (4-uint8_t IEEE 754) from the Propeller (MSB first)
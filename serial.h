@@ -4,7 +4,10 @@
 
 #include <stdint.h>
 
+#include "impair.h"
+
 void serial_start(int port); // starts serial communication
+int serial_impair(int port, const struct impair_params *params); // emulates a slow, noisy line to the box (see impair.h), returns 0 on success
 uint8_t serial_rx_byte(int port); // gets the next byte without waiting (0x00 == "none")
 uint8_t serial_rx_byte_wait(int port); // gets the next byte, waiting until it is received
 void serial_tx_byte(int port, uint8_t value); // sends a byte
@@ -1,5 +1,4 @@
 /*****TODO*****
- * Compare simulated data to real data
  * Implement fluctuations
  * Implement serial communication
  * LONG TERM:
@@ -29,22 +28,106 @@
  * graph creation, testing, etc.), put the line
  * 'serial off'
  * at the top of the run file.
+ *
+ * Many run files can be simulated at once with
+ * 'sim -b [-j workers] [-n] file1.run file2.run ...'
+ * Each run file is simulated in its own worker process (so a
+ * crash only loses that run); -n pins the workers to NUMA nodes.
+ * The run files are analyzed first to predict how long each takes
+ * (see analyze.h), and the longest ones start first.
+ * With '-o file.ens' the runs are collected into one ensemble file
+ * instead of one .dat file each; 'sim -e file.ens' lists the runs
+ * in an ensemble file and 'sim -e file.ens <run>' prints one of them.
+ * With '-J file.jnl' finished jobs are recorded in a journal, and
+ * running the same batch again with the same journal skips them (a run
+ * that reached the ensemble file just before an interruption is found by
+ * the batch id and job number in its metadata, and not appended again).
+ *
+ * Messages from the serial protocol loop are written by a background thread
+ * (see log.h); 'sim -L file.log ...' also logs them to a file with
+ * timestamps and 'sim -l level ...' hides the ones below level on the
+ * terminal (debug, info, warn or error).
+ *
+ * 'sim -U ...' writes output files and talks to the box through io_uring
+ * (Linux, see uring.h), batching writes and keeping a serial read in flight
+ * instead of a system call per byte; without it, plain I/O is used.
+ *
+ * 'sim -z ...' writes the output columns compressed (see gorilla.h) to
+ * file.gor instead of file.dat; 'sim -Z file.gor' prints them as text.
+ * 'sim -a ...' writes them as an Arrow IPC stream (see arrow.h) to
+ * file.arrows instead, for analysis tools to map without parsing.
+ *
+ * 'sim -R file.rec file.run' records every input of the run (run file
+ * lines, bytes from the box, the random seed and clock readings), and
+ * 'sim -r file.rec' replays it exactly, as fast as possible, writing
+ * file.replay.dat (no serial port is needed to replay a serial session).
+ * While recording, a snapshot of the simulation is saved every hour of
+ * simulated time (or every <interval> seconds with '-R file.rec -S <interval>'),
+ * so 'sim -r file.rec -s <time>' can start from the last snapshot before
+ * <time>; output starts at <time>.
+ *
+ * 'sim -p [-j threads] file...' parses data files (.dat outputs or CSV
+ * experiment logs) in parallel chunks and summarizes their columns.
+ * 'sim -c [-j threads] [-t offset] file.dat|file.ens log...' compares the
+ * simulated polarization with experiment logs (see compare.h), giving the
+ * residuals for every segment of each log (beam on, trip, anneal).
+ * 'sim -d file.run "commands" ["commands"]' runs the run file twice side
+ * by side, each time with its own extra commands (run file lines separated
+ * by ';', carried out right after initialization, e.g. "temp 1.2; mwpw 0.5"),
+ * writes the step by step differences to file.diff.dat and sums them up
+ * (what each side prints while it runs goes to stderr).
  ********************************************/
 
 /*****INPUT FILE COMMANDS*****
  * serial (on/off) - Turns the serial communications on or off
  *
- * init - Starts the initializer block
- **** rand (on/off) - Turns thermal fluctuations on/off
- **** annl (time) (temp) - Simulates a previous anneal
+ * init - Starts the initializer block (the material's history before the run, which is
+ *        set up in closed form rather than simulated; must come before the first 'time')
+ **** rand (on/off) - Turns thermal fluctuations on/off (not modelled, ignored)
+ **** dose (dose) - Beam dose the material received (in Pe/cm^2, adds up)
+ **** annl (time) (temp) - Records a previous anneal (after the dose so far); only the
+ ****                      count and dose are kept, since the model has no dose damage
+ ****                      yet for an anneal to undo (time and temp are ignored)
  **** mfld (field strength) - Sets the magnetic field strength
  **** temp (temperature) - Sets the temperature
- * done - Ends the initializer block
+ **** freq (number) - Sets the frequency the material was polarized at
+ * done - Ends the initializer block (every species is left at its steady state)
  *
  * freq (number) - Sets the frequency to <number> GHz
  * time (time) - Runs until the time <time> seconds
  * time +(time) - Runs for <time> seconds past the current time
  * beam (on/off) - Turns beam on/off
+ * temp (temperature) - Sets the fridge base temperature
+ * thrm (on/off) - Turns the fridge thermal model on/off (temperature then follows the heat load)
+ * mwpw (power) - Sets the microwave power reaching the sample, in W
+ * qmtr (on/off) [points] - Synthesizes a Q-meter NMR sweep (default 400 points) every
+ *                          time step and sends the polarization measured from it to the box
+ * nois (rms) - Sets the Q-meter noise (relative to the signal height at 100% polarization)
+ * drft (rms) - Sets how far the Q-meter baseline wanders per sweep (same units)
+ * fmod (amplitude) [sine/triangle/square] [points] - Modulates the microwave frequency by
+ *               +-<amplitude> GHz around the set frequency (averaged over <points> per cycle)
+ * fmod off - Turns the frequency modulation off
+ * kalm (on/off) [budget] - (Serial only) Keeps the polarization in step with the box by
+ *               filtering the polarization rate it reports (see kalman.h); updates are
+ *               skipped on ticks that already took over <budget> microseconds (default 500);
+ *               it adds columns, so it can't be turned on or off once rows are written
+ * rota (period) [size] - (Serial only) Splits the rest of the output into segments of
+ *               <period> simulated seconds (0 == any length), each at most <size> MB,
+ *               listed in a manifest (see rotate.h)
+ * rota off - Goes back to a single output file (appended to)
+ * tlmy (port) [rate] [every] - Serves the output rows live on ws://127.0.0.1:<port>/, in
+ *               batches <rate> times a second (default 10), keeping every <every>-th row
+ *               (see telemetry.h)
+ * tlmy off - Stops serving them
+ * link (baud) [latency] [jitter] [drop] [corrupt] [seed] - (Serial only) Emulates a real line
+ *               to the box (see impair.h): bytes take 10 bits each at <baud> (0 == no limit),
+ *               plus <latency> and up to <jitter> more milliseconds; each byte is lost with
+ *               probability <drop> or has a bit flipped with probability <corrupt> (the same
+ *               bytes for the same <seed>, the run's seed by default)
+ * link off - Goes back to the bare port
+ * spec (name) - Also polarizes another nuclear species ("deuteron"), whose polarization
+ *               is added as an extra column of the output (so it must come before the
+ *               first 'time', and can't be used with -z, -a, -d or an ensemble)
  * trip (time) - Simulates a beam trip for <time> seconds (ha6lf is trip, ha6lf is decay)
  * annl (time) (temp) - Anneals the material
  *****************************/
@@ -56,6 +139,7 @@
  * Frequency: in GHz
  * Field: in T
  * Temperature: in K
+ * Power: in W
  ***************/
 
 /*****MODEL*****
@@ -64,6 +148,14 @@
  * P_infinity = steady state polarization (function of frequency)
  * A = some constant (determined by initial polarization)
  * lambda = a rate constant (function of frequency)
+ * Each nuclear species follows this model with its own curves (see species.h);
+ * the first one (protons) is the one reported to the box
+ * P_infinity falls off with the sample temperature, which (with the
+ * thermal model on) is driven by the beam and microwave heat loads
+ * against the fridge cooling power (see thermal.h)
+ * With frequency modulation, lambda is the average over the cycle and
+ * P_infinity the lambda-weighted average (the modulation is much faster
+ * than the polarization)
  ***************/
 
 #include <stdbool.h>
@@ -75,11 +167,33 @@
 #include <math.h>
 #include <time.h>
 
+#include "analyze.h"
+#include "arena.h"
+#include "arrow.h"
+#include "batch.h"
+#include "compare.h"
+#include "diff.h"
+#include "direct.h"
+#include "ens.h"
+#include "format.h"
+#include "gorilla.h"
 #include "helper.h"
+#include "impair.h"
+#include "kalman.h"
+#include "log.h"
+#include "nmr.h"
+#include "parse.h"
+#include "record.h"
+#include "rotate.h"
 #include "script.h"
 #include "serial.h"
+#include "species.h"
+#include "telemetry.h"
+#include "thermal.h"
+#include "uring.h"
 
 bool serial_on = false; // Whether to enable the serial interface (off by default)
+uint32_t seed; // Random number generator seed
 int port = 9; // Serial COM port - 1 (eg COM8 == 7)
 
 // Simulation variables
@@ -88,10 +202,67 @@ double freq = 140.145; // In GHz
 double field = 5.0; // Field, in T
 double temp = 1.0; // Temperature, in K
 
+// Fridge
+const double BEAM_HEAT = 250.0; // Beam heat load per unit dose rate (W per Pe/cm^2/s)
+bool thermal_on = false; // Whether temp follows the thermal model (otherwise it stays fixed)
+struct thermal fridge; // Sample and bath temperatures
+void set_temp(double temperature); // Sets the fridge base temperature
+
+// NMR
+const int DEFAULT_SWEEP_POINTS = NMR_DEFAULT_POINTS; // Points per Q-meter sweep
+bool qmeter_on = false; // Whether to synthesize Q-meter sweeps (and report the measured polarization)
+struct nmr qmeter; // Q-meter sweep generator
+
 // Simulation control
 const double DELTA_T = 1.0; // Simulated time step in seconds (NOT actual time step)
 const double DELAY = 1.0; // Actual time step in seconds, when serial is on (NOT simulation time step)
 
+// Run functions
+int run_file(char *input_filename); // Runs a single run file, returns 0 on success
+int next_line(); // Reads the next run file line (from the file or a recording), returns 0 at the end
+void run_command(); // Carries out the current run file line
+void run_init_command(); // Carries out the current line of the init block
+void settle_history(); // Leaves the material as its history would have (at the end of the init block)
+
+// Snapshots (see record.h; changing this needs a new REC_VERSION in record.c)
+struct sim_state {
+    double sim_time;
+    double freq;
+    double field;
+    double temp;
+    double dose_rate;
+    double last_anneal_dose;
+    double dose;
+    int n_anneals;
+    double pol;
+    struct species_set species;
+    double pol_rate;
+    int direction;
+    bool serial_on;
+    int port;
+    bool thermal_on;
+    struct thermal fridge;
+    bool qmeter_on;
+    struct nmr qmeter;
+    struct fm modulation;
+    bool kalman_on;
+    struct kalman filter;
+    bool pol_rate_fresh;
+};
+double snapshot_interval = 3600.0; // Simulated time between snapshots while recording
+double next_snapshot = 0.0; // Simulation time of the next snapshot
+double seek_time = 0.0; // Replay: no output before this time (0 == from the start)
+void save_state(struct sim_state *state); // Copies the engine state into state
+void restore_state(const struct sim_state *state); // Makes state the engine state
+void take_snapshot(); // Records a snapshot if one is due
+int run_batch(int n_files, char **args); // Runs many run files in worker processes (sim -b ...)
+int batch_job(int job, struct batch_result *result); // Runs one batch job in a worker
+char **batch_files; // Run files of the current batch (indexed by job)
+uint64_t run_offset = 0; // Where the last run was stored in the ensemble file
+struct journal *batch_journal = NULL; // Journal of the current batch (if any)
+char *job_tag = NULL; // "job=<batch>/<job>" line in the metadata of a journaled job's ensemble record
+void recover_appended(struct journal *journal); // Marks jobs done whose run is in the ensemble but not the journal
+
 // Simulation functions
 void sim_init(); // Runs initialization for simulation
 void run_until(double until); // Runs until a certain time
@@ -106,18 +277,23 @@ double dose_rate = 0.0; // The current rate of dose deposit (related to the beam
 double last_anneal_dose = 0.0; // Dose at the last anneal
 double dose = 0.0; // The current dose
 int n_anneals = 0; // Number of anneals so far
+bool in_init = false; // Between 'init' and 'done'
+bool skip_init = false; // The init block came too late and is ignored
 
 // Polarization variables
-double pol = 0.0; // The current polarization
-double a_param = 1.0; // The A parameter from the model
+double pol = 0.0; // The current polarization (of species 0)
+struct species_set species; // Every polarized species, with its A parameter
 double pol_rate; // The polarization rate, as obtained from the box
 
+// Frequency modulation
+struct fm modulation; // Amplitude 0 == off
+unsigned model_version = 0; // Bumped whenever the species or the modulation change
+
 // Polarization functions
-double optimal_freq_pos(); // Optimal frequency for polarizing positively
-double optimal_freq_neg(); // Optimal frequency for polarizing negatively
-double get_steady_state(); // Calculates P_infinity from the current frequency
-double get_lambda(); // Calculates the parameter "lambda" from the current frequency
-void update_a_param(); // Updates the A parameter (to be run every time the frequency is changed)
+void model(double *ss, double *lambda); // Steady state and rate of every species at the current frequency (or modulation)
+double get_steady_state(); // Calculates P_infinity (of species 0) from the current frequency
+double get_lambda(); // Calculates the parameter "lambda" (of species 0) from the current frequency
+void update_a_param(); // Updates the A parameters (to be run every time the frequency is changed)
 void update_pol(); // Updates the polarization (to be run after every time step)
 
 // Frequency functions
@@ -125,11 +301,67 @@ void set_freq(double frequency); // Sets the frequency (also does other necessar
 
 // File I/O
 FILE *output; // Data output
+char *output_path = NULL; // Where the output goes (while running)
+char *result_path = NULL; // The file the rows end up in, whatever its format (synced before a journaled job is done)
+struct rotation rotation; // Output segments of a long serial session
+bool rotating = false;
 const size_t BUF_LEN = 200; // Length of buffer to read commands into
+const size_t ROW_LEN = 4096; // Longest serial output row (numbers as huge as doubles get)
+const size_t OUTPUT_BUF_LEN = 65536; // Size of the stdio buffer for the output file
+char *output_buf = NULL; // That buffer (in the run arena, kept for when the output is reopened)
+bool formatting = false; // Rows of the output are formatted in parallel (see format.h)
+bool format_tried = false; // Whether this run has asked for formatting threads (it only asks once)
+bool output_started = false; // A row has been written, so the columns can't change any more
+const unsigned long long DIRECT_MIN_BYTES = 64ULL << 20; // Outputs expected to be larger are preallocated (see direct.h)
 void output_data(); // Output data to file
 
+// Ensemble output (all runs of a batch in one file, see ens.h)
+#define N_COLUMNS 7 // Number of data columns per row
+const char COLUMN_NAMES[N_COLUMNS][ENS_NAME_LEN] = {"time", "freq", "pol", "steady_state", "lambda", "pol_rate", "direction"};
+char *ensemble_path = NULL; // Ensemble file to collect runs into (NULL == write .dat files)
+struct ens_run ensemble_run; // Rows of the current run, until it is appended to the ensemble
+char *read_run_text(char *filename); // Reads a whole run file into the run arena (for metadata), NULL if out of memory
+int dump_ensemble(int argc, char **argv); // Lists or prints the runs in an ensemble file (sim -e ...)
+int summarize_files(int argc, char **argv); // Parses data files and summarizes their columns (sim -p ...)
+int compare_files(int argc, char **argv); // Compares a simulation with experiment logs (sim -c ...)
+
+// Side by side runs (see diff.h)
+const double DIVERGED_POL = 0.1; // Polarization difference (in %) that counts as diverged
+char *diff_run_file; // Run file both sides run
+char *diff_params[2]; // Extra commands of each side
+char *diff_commands = NULL; // This side's extra commands ("cmd; cmd")
+FILE *diff_output = NULL; // Rows go down this pipe instead of to a .dat file
+int run_diff(int argc, char **argv); // Runs a run file with two sets of parameters and compares them (sim -d ...)
+int diff_side(int side, FILE *rows); // Runs one side of a side by side run
+void run_commands(char *commands); // Carries out extra commands (keeping the current run file line)
+
+// Compressed output (see gorilla.h)
+bool compress_output = false; // Write file.gor instead of file.dat
+struct gorilla_writer compressed;
+int print_compressed(int argc, char **argv); // Prints a compressed output as text (sim -Z ...)
+
+// Live telemetry (see telemetry.h)
+const double DEFAULT_TELEMETRY_RATE = 10; // Batches per second
+bool telemetry_on = false;
+
+// Arrow output (see arrow.h)
+bool arrow_output = false; // Write file.arrows instead of file.dat
+struct arrow_writer arrow;
+
+// Memory
+const size_t ARENA_BLOCK_LEN = 262144; // Size of each block of the per-run arena
+struct arena run_arena; // Holds every buffer a run needs (freed in one shot at the end)
+
 // Box data
 int direction; // The current motor direction
+bool pol_rate_fresh = false; // Whether the box sent a polarization rate since the last tick
+
+// Tracking the box (see kalman.h)
+const double DEFAULT_TICK_BUDGET = 500e-6; // Seconds
+bool kalman_on = false;
+struct kalman filter;
+void track_box(double tick_start); // Folds the box's latest observation into the polarization (once per tick)
+void print_latency(); // Prints how long the ticks took
 
 // Serial communications
 void serial_init(); // Initializes serial comm.
@@ -142,101 +374,1101 @@ void tx_event_num();
 void rx_pol_rate();
 void rx_direction();
 void tx_pol();
+void tx_sweep(); // Sends the last Q-meter sweep
 
 int main(int argc, char **argv) {
+    // Logging and I/O options
+    while ((argc >= 3 && (!strcmp(argv[1], "-L") || !strcmp(argv[1], "-l")))
+           || (argc >= 2 && (!strcmp(argv[1], "-U") || !strcmp(argv[1], "-z") || !strcmp(argv[1], "-a")))) {
+        if (argv[1][1] == 'U' || argv[1][1] == 'z' || argv[1][1] == 'a') {
+            if (argv[1][1] == 'z') {
+                compress_output = true;
+            } else if (argv[1][1] == 'a') {
+                arrow_output = true;
+            } else if (uring_start()) {
+                puts("io_uring is not available, using plain I/O");
+            }
+            argv += 1;
+            argc -= 1;
+            continue;
+        }
+        if (argv[1][1] == 'L' && log_open(argv[2])) {
+            printf("Could not open log file: %s\n", argv[2]);
+            return 1;
+        } else if (argv[1][1] == 'l') {
+            int level = log_level(argv[2]);
+            if (level < 0) {
+                printf("Unknown log level: %s (debug, info, warn or error)\n", argv[2]);
+                return 1;
+            }
+            log_set_level(level);
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
+    // Record or replay the run's inputs if asked to
+    if (argc >= 3 && !strcmp(argv[1], "-R")) {
+        if (record_open(argv[2])) {
+            printf("Could not create recording: %s\n", argv[2]);
+            return 1;
+        }
+        argv += 2;
+        argc -= 2;
+        if (argc >= 3 && !strcmp(argv[1], "-S")) {
+            snapshot_interval = atof(argv[2]);
+            argv += 2;
+            argc -= 2;
+        }
+    } else if (argc >= 3 && !strcmp(argv[1], "-r")) {
+        if (replay_open(argv[2])) {
+            printf("Could not open recording: %s\n", argv[2]);
+            return 1;
+        }
+        if (argc == 5 && !strcmp(argv[3], "-s")) {
+            seek_time = atof(argv[4]);
+            argc -= 2;
+        }
+        // The recording stands in for the run file
+        argv += 1;
+        argc -= 1;
+    }
+
     // Seed random number generator
-    srand(time(NULL));
+    seed = record_seed(time(NULL));
+    srand(seed);
+
+    if (arena_init(&run_arena, ARENA_BLOCK_LEN)) {
+        puts("Could not allocate memory, aborting");
+        return 1;
+    }
+
+    if (argc >= 2 && !strcmp(argv[1], "-b")) {
+        int ret = run_batch(argc - 2, argv + 2);
+        arena_free(&run_arena);
+        return ret;
+    } else if (argc >= 2 && !strcmp(argv[1], "-e")) {
+        int ret = dump_ensemble(argc - 2, argv + 2);
+        arena_free(&run_arena);
+        return ret;
+    } else if (argc >= 2 && !strcmp(argv[1], "-p")) {
+        int ret = summarize_files(argc - 2, argv + 2);
+        arena_free(&run_arena);
+        return ret;
+    } else if (argc >= 2 && !strcmp(argv[1], "-c")) {
+        int ret = compare_files(argc - 2, argv + 2);
+        arena_free(&run_arena);
+        return ret;
+    } else if (argc >= 2 && !strcmp(argv[1], "-d")) {
+        int ret = run_diff(argc - 2, argv + 2);
+        arena_free(&run_arena);
+        return ret;
+    } else if (argc >= 2 && !strcmp(argv[1], "-Z")) {
+        int ret = print_compressed(argc - 2, argv + 2);
+        arena_free(&run_arena);
+        return ret;
+    }
 
-    bool allocated = false; // Whether we need to free the input_filename buffer
     char *input_filename;
     if (argc < 2) {
         // Prompt for an input filename
         printf("Script filename: ");
-        input_filename = malloc(BUF_LEN*sizeof(char));
-        allocated = true;
-        fgets(input_filename, BUF_LEN, stdin);
+        input_filename = arena_alloc(&run_arena, BUF_LEN*sizeof(char));
+        if (!input_filename || !fgets(input_filename, BUF_LEN, stdin)) {
+            puts("No script filename");
+            return 1;
+        }
         strip_newline(input_filename);
     } else if (argc == 2) {
         input_filename = argv[1];
     } else {
-        puts("Too many arguments");
+        puts("Too many arguments (use -b for batch mode)");
+        return 1;
+    }
+    
+    int failed = run_file(input_filename);
+    record_close();
+    uring_stop();
+    log_close();
+    arena_free(&run_arena);
+    if (failed) {
         return 1;
     }
+    puts("Simulation finished successfully (press enter to exit)");
+    getchar();
     
-    int failed = script_fopen(input_filename);
+    return 0;
+}
+
+int run_file(char *input_filename) {
+    bool replaying = record_mode == REC_REPLAYING;
+    int failed = replaying ? 0 : script_fopen(input_filename);
     if (failed) {
         printf("Could not open file: %s\n", input_filename);
-        if (allocated) {
-            free(input_filename);
-        }
         return 1;
     }
-    char *output_filename = input_filename;
-    strip_extension(output_filename);
-    strcat(output_filename, ".dat");
-    output = fopen(output_filename, "w");
-    // Free buffer if we used it
-    if (allocated) {
-        free(input_filename);
+    if (ensemble_path) {
+        // Rows are kept in the arena and appended to the ensemble at the end,
+        // along with the run file itself (which holds all of the run's parameters)
+        char *text = read_run_text(input_filename);
+        const char *tag = job_tag ? job_tag : "";
+        char *meta = text ? arena_alloc(&run_arena, strlen(input_filename) + strlen(tag) + strlen(text) + 8) : NULL;
+        if (!meta) {
+            puts("Out of memory for the run's metadata");
+            if (!replaying) script_fclose();
+            return 1;
+        }
+        sprintf(meta, "file=%s\n%s%s", input_filename, tag, text);
+        ens_run_begin(&ensemble_run, &run_arena, N_COLUMNS, COLUMN_NAMES, meta);
+        output = NULL;
+    } else if (diff_output) {
+        output = NULL;
+    } else if (arrow_output) {
+        char *arrow_filename = arena_alloc(&run_arena, strlen(input_filename) + 16);
+        if (!arrow_filename) {
+            puts("Out of memory for the output file name");
+            if (!replaying) script_fclose();
+            return 1;
+        }
+        strcpy(arrow_filename, input_filename);
+        strip_extension(arrow_filename);
+        strcat(arrow_filename, replaying ? ".replay.arrows" : ".arrows");
+        if (arrow_open(&arrow, arrow_filename, N_COLUMNS, COLUMN_NAMES)) {
+            printf("Could not open output file: %s\n", arrow_filename);
+            if (!replaying) script_fclose();
+            return 1;
+        }
+        result_path = arrow_filename;
+        output = NULL;
+    } else if (compress_output) {
+        char *compressed_filename = arena_alloc(&run_arena, strlen(input_filename) + 12);
+        if (!compressed_filename) {
+            puts("Out of memory for the output file name");
+            if (!replaying) script_fclose();
+            return 1;
+        }
+        strcpy(compressed_filename, input_filename);
+        strip_extension(compressed_filename);
+        strcat(compressed_filename, replaying ? ".replay.gor" : ".gor");
+        if (gorilla_open(&compressed, compressed_filename, N_COLUMNS, COLUMN_NAMES)) {
+            printf("Could not open output file: %s\n", compressed_filename);
+            if (!replaying) script_fclose();
+            return 1;
+        }
+        result_path = compressed_filename;
+        output = NULL;
+    } else {
+        // Leave room for the extension in case the input has none
+        char *output_filename = arena_alloc(&run_arena, strlen(input_filename) + 12);
+        if (!output_filename) {
+            puts("Out of memory for the output file name");
+            if (!replaying) script_fclose();
+            return 1;
+        }
+        strcpy(output_filename, input_filename);
+        strip_extension(output_filename);
+        strcat(output_filename, replaying ? ".replay.dat" : ".dat");
+        // Large outputs are allocated up front and kept out of the page cache
+        struct run_plan plan;
+        if (!uring_on && !replaying && !analyze_run(input_filename, DELTA_T, &plan) && plan.bytes >= DIRECT_MIN_BYTES) {
+            printf("Expected output: %lu rows, about %llu MB\n", plan.rows, plan.bytes >> 20);
+            output = direct_fopen(output_filename, plan.bytes);
+        } else {
+            output = uring_on ? uring_fopen(output_filename, "w") : fopen(output_filename, "w");
+        }
+        if (!output) {
+            printf("Could not open output file: %s\n", output_filename);
+            if (!replaying) script_fclose();
+            return 1;
+        }
+        output_path = output_filename;
+        result_path = output_filename;
+        // Output rows are buffered in the arena, so the output loop never allocates
+        output_buf = arena_alloc(&run_arena, OUTPUT_BUF_LEN);
+        if (!output_buf) {
+            puts("Out of memory for the output buffer");
+            fclose(output);
+            output = NULL;
+            if (!replaying) script_fclose();
+            return 1;
+        }
+        setvbuf(output, output_buf, _IOFBF, OUTPUT_BUF_LEN);
     }
     
-    // Check for serial on/off line
-    int read = script_readline();
-    if (script_cmdequ("serial")) {
+    int read;
+    struct sim_state snapshot;
+    if (seek_time > 0 && !replay_seek(seek_time, &snapshot, sizeof(snapshot))) {
+        // Carry on from the last snapshot before the seek time
+        restore_state(&snapshot);
+        printf("Resuming from snapshot at time %6lf\n", sim_time);
+        if (serial_on) {
+            serial_init();
+        }
+        read = next_line();
+    } else {
+        // Check for serial on/off line
+        read = next_line();
+        if (script_cmdequ("serial")) {
+            if (!strcmp(script_getarg(0), "on")) {
+                char *port_name = script_getarg(1);
+                if (!port_name) {
+                    puts("Must specify a serial port to use serial, aborting");
+                    return 1;
+                }
+                int port_temp = get_port(port_name);
+                if (port_temp == -1) {
+                    puts("Invalid port name (must be COMxx)");
+                    return 1;
+                }
+                port = port_temp;
+                printf("Serial on for port %d\n", port);
+                serial_on = true;
+            } else if (!strcmp(script_getarg(0), "off")) {
+                puts("Serial off");
+                serial_on = false;
+            } else {
+                puts("Invalid serial instruction, continuing with serial off");
+                serial_on = false;
+            }
+            // Get next command ready
+            read = next_line();
+        }
+        if (serial_on && diff_output) {
+            puts("Serial runs can not be run side by side");
+            script_fclose();
+            return 1;
+        }
+
+        sim_init();
+        puts("Initialized simulation");
+        if (diff_commands) {
+            run_commands(diff_commands);
+        }
+    }
+    
+    // Command loop (everything it needs is allocated by now)
+    size_t n_mallocs = run_arena.n_mallocs;
+    do {
+        run_command();
+    } while ((read = next_line()));
+    // Ensemble rows are the only thing that may grow while running
+    if (run_arena.n_mallocs > n_mallocs && !ensemble_path) {
+        log_msg(LOG_WARN, "The run needed %lu more arena blocks while running (%lu allocations in all)",
+                (unsigned long)(run_arena.n_mallocs - n_mallocs), (unsigned long)run_arena.n_allocs);
+    }
+    
+    if (kalman_on) {
+        print_latency();
+    }
+
+    // Close files and release the run's memory
+    failed = 0;
+    if (ensemble_path) {
+        failed = ens_run_append(&ensemble_run, ensemble_path, &run_offset);
+    }
+    if (rotating) {
+        rotate_close(&rotation);
+        rotating = false;
+    }
+    memset(&rotation, 0, sizeof(rotation)); // The next run starts its own manifest
+    if (telemetry_on) {
+        telemetry_stop();
+        telemetry_on = false;
+    }
+    impair_stop();
+    if (arrow_output && !ensemble_path && !diff_output) {
+        if (arrow_close(&arrow)) {
+            puts("Could not write all of the output");
+            failed = 1;
+        }
+    } else if (compress_output && !ensemble_path && !diff_output) {
+        if (gorilla_close(&compressed)) {
+            puts("Could not write all of the output");
+            failed = 1;
+        }
+        unsigned long rows = compressed.total_rows;
+        printf("Compressed output: %lu rows in %llu bytes (%6lf bits per value)\n", rows, compressed.total_bytes,
+               rows ? 8.0*compressed.total_bytes / (rows*N_COLUMNS) : 0.0);
+    }
+    if (output) {
+        if (formatting && format_finish()) {
+            puts("Could not write all of the output");
+            failed = 1;
+        }
+        formatting = false;
+        if (fclose(output)) {
+            puts("Could not write all of the output");
+            failed = 1;
+        }
+    }
+    // The journal will say the job is done, so its output must survive a crash from here on
+    if (batch_journal && result_path && !failed && sync_file(result_path)) {
+        printf("Could not sync the output: %s\n", result_path);
+        failed = 1;
+    }
+    result_path = NULL;
+    output_started = false;
+    format_tried = false;
+    output_path = NULL;
+    if (!replaying) script_fclose();
+    arena_reset(&run_arena);
+    
+    return failed;
+}
+
+void run_command() {
+    if (in_init) {
+        run_init_command();
+        return;
+    }
+    if (script_cmdequ("init")) {
+        in_init = true;
+        // The history has to be in place before anything is simulated
+        skip_init = sim_time > 0.0;
+        if (skip_init) {
+            puts("The init block must come before the run starts, ignoring it");
+        }
+    } else if (script_cmdequ("freq")) {
+        double tmp;
+        sscanf(script_getarg(0), "%6lf", &tmp);
+        set_freq(tmp);
+        printf("Set frequency: %6lf\n", freq);
+    } else if (script_cmdequ("time")) {
+        double until;
+        sscanf(script_getarg(0), "%6lf", &until);
+        printf("Running until time: %6lf\n", until);
+        run_until(until);
+    } else if (script_cmdequ("beam")) {
         if (!strcmp(script_getarg(0), "on")) {
-            char *port_name = script_getarg(1);
-            if (!port_name) {
-                puts("Must specify a serial port to use serial, aborting");
-                return 1;
+            puts("Turning beam on");
+            dose_rate = MAX_DOSE_RATE;
+        } else if (!strcmp(script_getarg(0), "off")) {
+            puts("Turning beam off");
+            dose_rate = 0.0;
+        }
+    } else if (script_cmdequ("temp")) {
+        double tmp;
+        sscanf(script_getarg(0), "%lf", &tmp);
+        set_temp(tmp);
+        printf("Set temperature: %6lf K\n", tmp);
+    } else if (script_cmdequ("thrm")) {
+        if (!strcmp(script_getarg(0), "on")) {
+            puts("Thermal model on");
+            thermal_on = true;
+        } else if (!strcmp(script_getarg(0), "off")) {
+            puts("Thermal model off");
+            thermal_on = false;
+            set_temp(fridge.t_base);
+        }
+    } else if (script_cmdequ("qmtr")) {
+        if (!strcmp(script_getarg(0), "on")) {
+            int points = atoi(script_getarg(1));
+            nmr_init(&qmeter, points > 0 ? points : DEFAULT_SWEEP_POINTS, seed);
+            qmeter_on = true;
+            printf("Q-meter on (%d points per sweep)\n", qmeter.n_points);
+        } else if (!strcmp(script_getarg(0), "off")) {
+            puts("Q-meter off");
+            qmeter_on = false;
+        }
+    } else if (script_cmdequ("nois")) {
+        sscanf(script_getarg(0), "%lf", &qmeter.noise);
+        printf("Set Q-meter noise: %6lf\n", qmeter.noise);
+    } else if (script_cmdequ("drft")) {
+        sscanf(script_getarg(0), "%lf", &qmeter.drift);
+        printf("Set Q-meter baseline drift: %6lf\n", qmeter.drift);
+    } else if (script_cmdequ("fmod")) {
+        double amplitude = 0.0;
+        if (strcmp(script_getarg(0), "off")) {
+            sscanf(script_getarg(0), "%lf", &amplitude);
+        }
+        if (amplitude <= 0.0) {
+            puts("Frequency modulation off");
+            modulation.amplitude = 0.0;
+        } else if (fm_set(&modulation, amplitude, *script_getarg(1) ? script_getarg(1) : "sine", atoi(script_getarg(2)))) {
+            printf("Unknown modulation shape: %s\n", script_getarg(1));
+        } else {
+            printf("Set frequency modulation: %6lf GHz (%d points per cycle)\n", modulation.amplitude, modulation.n_points);
+        }
+        model_version++;
+        update_a_param();
+    } else if (script_cmdequ("kalm")) {
+        bool on = !strcmp(script_getarg(0), "on");
+        if ((on || !strcmp(script_getarg(0), "off")) && on != kalman_on && output_started) {
+            // The filter's columns are only in the rows written while it is on
+            printf("The Kalman filter must be turned %s before the first row is written, ignoring kalm\n",
+                   on ? "on" : "off");
+            return;
+        }
+        if (on) {
+            if (!serial_on) {
+                puts("The Kalman filter needs serial on (it filters what the box reports)");
+                return;
+            }
+            double budget = atof(script_getarg(1));
+            kalman_init(&filter, pol, budget > 0 ? budget*1e-6 : DEFAULT_TICK_BUDGET);
+            kalman_on = true;
+            pol_rate_fresh = false;
+            printf("Kalman filter on (%6lf us per tick)\n", filter.budget*1e6);
+        } else if (!strcmp(script_getarg(0), "off")) {
+            puts("Kalman filter off");
+            if (kalman_on) print_latency();
+            kalman_on = false;
+        }
+    } else if (script_cmdequ("tlmy")) {
+        if (telemetry_on) {
+            telemetry_stop();
+            telemetry_on = false;
+        }
+        if (!strcmp(script_getarg(0), "off")) {
+            puts("Telemetry off");
+            return;
+        }
+        int tlmy_port = atoi(script_getarg(0));
+        double rate = atof(script_getarg(1));
+        int every = atoi(script_getarg(2));
+        if (rate <= 0) rate = DEFAULT_TELEMETRY_RATE;
+        if (every < 1) every = 1;
+        if (tlmy_port <= 0 || tlmy_port > 65535 || telemetry_start(tlmy_port, rate, every, N_COLUMNS, COLUMN_NAMES)) {
+            printf("Could not serve telemetry on port %s\n", script_getarg(0));
+            return;
+        }
+        telemetry_on = true;
+        printf("Serving telemetry on ws://127.0.0.1:%d/ (%6lf batches per second, every %d rows)\n", tlmy_port, rate, every);
+    } else if (script_cmdequ("link")) {
+        if (!strcmp(script_getarg(0), "off")) {
+            if (impair_on) {
+                impair_stop();
+                puts("Line emulation off");
             }
-            int port_temp = get_port(port_name);
-            if (port_temp == -1) {
-                puts("Invalid port name (must be COMxx)");
+            return;
+        }
+        if (!serial_on || record_mode == REC_REPLAYING) {
+            puts("Line emulation is for live serial sessions (a replay has the bytes as they arrived)");
+            return;
+        }
+        struct impair_params line = {atoi(script_getarg(0)), atof(script_getarg(1))*1e-3, atof(script_getarg(2))*1e-3,
+                                     atof(script_getarg(3)), atof(script_getarg(4)), seed};
+        if (*script_getarg(5)) {
+            line.seed = strtoull(script_getarg(5), NULL, 10);
+        }
+        if (serial_impair(port, &line)) {
+            puts("Invalid line emulation (baud, latency and jitter can't be negative, drop and corrupt are probabilities)");
+            return;
+        }
+        printf("Emulating the line: %d baud, %6lf ms latency, %6lf ms jitter, %6lf drop, %6lf corrupt\n",
+               line.baud, line.latency*1e3, line.jitter*1e3, line.drop, line.corrupt);
+    } else if (script_cmdequ("rota")) {
+        if (!strcmp(script_getarg(0), "off")) {
+            if (rotating) {
+                puts("Output rotation off");
+                rotate_close(&rotation);
+                rotating = false;
+                // Written the way it was before rotating (direct I/O is never used for serial sessions)
+                output = uring_on ? uring_fopen(output_path, "a") : fopen(output_path, "a");
+                if (!output) {
+                    printf("Could not open output file: %s\n", output_path);
+                } else {
+                    setvbuf(output, output_buf, _IOFBF, OUTPUT_BUF_LEN);
+                }
+            }
+            return;
+        }
+        if (!serial_on || !output_path) {
+            puts("Output rotation is for serial sessions writing a .dat file");
+            return;
+        }
+        double period = atof(script_getarg(0));
+        double size = atof(script_getarg(1));
+        if (rotating) {
+            rotate_close(&rotation);
+            rotating = false;
+        }
+        char *base = arena_alloc(&run_arena, strlen(output_path) + 1);
+        if (!base) {
+            puts("Out of memory, ignoring rota");
+            return;
+        }
+        strcpy(base, output_path);
+        strip_extension(base);
+        if (rotate_open(&rotation, base, period, (unsigned long long)(size*1048576))) {
+            printf("Could not create the manifest for %s\n", base);
+            return;
+        }
+        rotating = true;
+        printf("Rotating output every %6lf s (at most %6lf MB per segment)\n", period, size);
+        // Whatever was written so far stays in the single file
+        if (output) {
+            fclose(output);
+            output = NULL;
+            remove_if_empty(output_path);
+        }
+    } else if (script_cmdequ("spec")) {
+        if (ensemble_path || compress_output || arrow_output || diff_output) {
+            // Those have a fixed set of columns, for species 0 only
+            puts("Extra species can't be stored in ensemble, compressed or Arrow output or compared side by side, ignoring spec");
+            return;
+        }
+        if (output_started) {
+            puts("Species must be added before the first row is written (it adds a column), ignoring spec");
+            return;
+        }
+        if (species_add(&species, script_getarg(0))) {
+            printf("Unknown species (or too many): %s\n", script_getarg(0));
+        } else {
+            printf("Added species: %s\n", script_getarg(0));
+            model_version++;
+            update_a_param();
+        }
+    } else if (script_cmdequ("mwpw")) {
+        sscanf(script_getarg(0), "%lf", &fridge.p_mw);
+        printf("Set microwave power: %6lf W\n", fridge.p_mw);
+    }
+}
+
+void run_init_command() {
+    if (script_cmdequ("done")) {
+        in_init = false;
+        if (!skip_init) {
+            settle_history();
+            printf("History: dose %6lf Pe/cm^2, anneals: %d (the last at %6lf), polarization %6lf%%\n",
+                   dose, n_anneals, last_anneal_dose, 100*pol);
+        }
+    } else if (skip_init) {
+        return;
+    } else if (script_cmdequ("dose")) {
+        double amount;
+        if (sscanf(script_getarg(0), "%lf", &amount) != 1 || amount < 0) {
+            printf("Invalid dose: %s\n", script_getarg(0));
+            return;
+        }
+        dose += amount;
+        printf("History: %6lf Pe/cm^2 of beam\n", amount);
+    } else if (script_cmdequ("annl")) {
+        // Only recorded (and kept in snapshots): the steady state doesn't depend on
+        // the dose since the last anneal yet, so the critical doses and
+        // ANNEAL_DECAY_FACTOR have nothing to act on
+        n_anneals++;
+        last_anneal_dose = dose;
+        printf("History: anneal %d at %6lf Pe/cm^2\n", n_anneals, dose);
+    } else if (script_cmdequ("mfld")) {
+        sscanf(script_getarg(0), "%lf", &field);
+        update_a_param();
+        printf("Set field: %6lf T\n", field);
+    } else if (script_cmdequ("temp")) {
+        double tmp;
+        sscanf(script_getarg(0), "%lf", &tmp);
+        set_temp(tmp);
+        printf("Set temperature: %6lf K\n", tmp);
+    } else if (script_cmdequ("freq")) {
+        double tmp;
+        sscanf(script_getarg(0), "%6lf", &tmp);
+        set_freq(tmp);
+        printf("Set frequency: %6lf\n", freq);
+    } else if (script_cmdequ("rand")) {
+        puts("Thermal fluctuations are not modelled, ignoring rand");
+    } else {
+        printf("Not allowed in the init block: %s\n", script_getarg(-1));
+    }
+}
+
+void settle_history() {
+    // The history is long next to 1/lambda (minutes), so whatever it was,
+    // every species has relaxed to the steady state of where it ended up
+    double ss[MAX_SPECIES], lambda[MAX_SPECIES];
+    model(ss, lambda);
+    memcpy(species.pol, ss, sizeof(ss));
+    pol = species.pol[0];
+    update_a_param();
+}
+
+void run_commands(char *commands) {
+    char line[BUF_LEN], command[BUF_LEN];
+    script_getline(line, BUF_LEN);
+    for (char *p = commands; *p; ) {
+        size_t len = strcspn(p, ";");
+        if (len >= BUF_LEN) len = BUF_LEN - 1;
+        memcpy(command, p, len);
+        command[len] = '\0';
+        p += len;
+        if (*p) p++;
+        if (script_parse(command)) {
+            run_command();
+        }
+    }
+    script_parse(line);
+}
+
+int run_batch(int n_files, char **args) {
+    int n_workers = 0; // 0 == let the batch runner decide
+    bool numa = false;
+    char *journal_path = NULL;
+
+    // Options come before the list of run files
+    while (n_files > 0 && args[0][0] == '-') {
+        if (!strcmp(args[0], "-j") && n_files > 1) {
+            n_workers = atoi(args[1]);
+            args += 2;
+            n_files -= 2;
+        } else if (!strcmp(args[0], "-o") && n_files > 1) {
+            ensemble_path = args[1];
+            args += 2;
+            n_files -= 2;
+        } else if (!strcmp(args[0], "-J") && n_files > 1) {
+            journal_path = args[1];
+            args += 2;
+            n_files -= 2;
+        } else if (!strcmp(args[0], "-n")) {
+            numa = true;
+            args++;
+            n_files--;
+        } else {
+            printf("Unknown batch option: %s\n", args[0]);
+            return 1;
+        }
+    }
+    if (n_files == 0) {
+        puts("Usage: sim -b [-j workers] [-n] [-o file.ens] [-J file.jnl] file1.run file2.run ...");
+        return 1;
+    }
+
+    batch_files = args;
+    struct journal journal;
+    if (journal_path && journal_open(&journal, journal_path, n_files, batch_files)) {
+        printf("Could not open journal: %s\n", journal_path);
+        return 1;
+    }
+    if (journal_path) {
+        batch_journal = &journal;
+        if (ensemble_path) {
+            recover_appended(&journal);
+        }
+    }
+    // Jobs running side by side share the CPUs for formatting their output
+    int n_left = n_files;
+    for (int i = 0; journal_path && i < n_files; i++) {
+        if (journal.done[i]) n_left--;
+    }
+    format_workers = batch_workers(n_left, n_workers, numa);
+    // Predict each job's time from its run file, so the longest start first
+    struct batch_estimate *estimates = calloc((unsigned)n_files, sizeof(struct batch_estimate)); // NULL == in order
+    for (int i = 0; estimates && i < n_files; i++) {
+        struct run_plan plan;
+        if (analyze_run(batch_files[i], DELTA_T, &plan)) continue; // Fails (quickly) in its worker
+        if (plan.serial) {
+            // A step per DELAY seconds, however fast the steps are
+            estimates[i].paced = plan.steps * DELAY;
+        } else {
+            estimates[i].work = plan.work;
+        }
+    }
+    struct batch_result *results = batch_run(n_files, n_workers, numa, estimates, batch_job, journal_path ? &journal : NULL);
+    free(estimates);
+    if (journal_path) {
+        journal_close(&journal);
+        batch_journal = NULL;
+    }
+    if (!results) {
+        return 1;
+    }
+
+    // Summary of every job, in job order
+    int n_failed = 0;
+    puts("Job  Status   Time          Polarization  File");
+    for (int i = 0; i < n_files; i++) {
+        printf("%-4d %-8s %-13lf %-13lf %s\n", i, batch_status_name(results[i].status),
+               results[i].sim_time, 100*results[i].pol, batch_files[i]);
+        if (results[i].status != BATCH_DONE && results[i].status != BATCH_SKIPPED) {
+            n_failed++;
+        }
+    }
+    printf("%d of %d jobs finished successfully\n", n_files - n_failed, n_files);
+    batch_free(results, n_files);
+
+    return n_failed ? 1 : 0;
+}
+
+void recover_appended(struct journal *journal) {
+    struct ens_file ens;
+    if (ens_open(&ens, ensemble_path)) return; // Nothing appended yet
+    for (size_t i = 0; i < ens.n_runs; i++) {
+        // All of it: the tag comes after the file name, which can be any length
+        size_t len = ens.runs[i].meta_len + 1;
+        char *meta = malloc(len);
+        if (!meta || ens_read_meta(&ens, i, meta, len)) {
+            free(meta);
+            continue;
+        }
+        // "file=<name>\njob=<batch>/<job>\n..."
+        char *tag = strstr(meta, "\njob=");
+        char id[JOURNAL_ID_LEN];
+        int job;
+        bool ours = tag && sscanf(tag, "\njob=%31[^/]/%d", id, &job) == 2 && !strcmp(id, journal->id)
+            && job >= 0 && job < journal->n_jobs && !journal->done[job];
+        free(meta);
+        if (!ours) continue;
+        printf("Journal: job %d (%s) is already in %s\n", job, batch_files[job], ensemble_path);
+        journal_done(journal, job, ens.runs[i].offset);
+    }
+    ens_close(&ens);
+}
+
+int batch_job(int job, struct batch_result *result) {
+    // Tag the ensemble record, so a resumed batch can tell it was appended
+    char tag[JOURNAL_ID_LEN + 32];
+    if (batch_journal) {
+        snprintf(tag, sizeof(tag), "job=%s/%d\n", batch_journal->id, job);
+        job_tag = tag;
+    }
+    int failed = run_file(batch_files[job]);
+    // Report the final state even for failed runs, so bad points can be inspected
+    result->sim_time = sim_time;
+    result->pol = pol;
+    result->dose = dose;
+    result->offset = run_offset;
+    if (!failed && !isfinite(pol)) {
+        printf("Job %d (%s): polarization is not finite\n", job, batch_files[job]);
+        failed = 1;
+    }
+    return failed;
+}
+
+int next_line() {
+    char line[BUF_LEN];
+    if (record_mode == REC_REPLAYING) {
+        return replay_line(line, BUF_LEN) ? script_parse(line) : 0;
+    }
+    int read = script_readline();
+    if (read && record_mode == REC_RECORDING) {
+        script_getline(line, BUF_LEN);
+        record_line(line);
+    }
+    return read;
+}
+
+void save_state(struct sim_state *state) {
+    state->sim_time = sim_time;
+    state->freq = freq;
+    state->field = field;
+    state->temp = temp;
+    state->dose_rate = dose_rate;
+    state->last_anneal_dose = last_anneal_dose;
+    state->dose = dose;
+    state->n_anneals = n_anneals;
+    state->pol = pol;
+    state->species = species;
+    state->pol_rate = pol_rate;
+    state->direction = direction;
+    state->serial_on = serial_on;
+    state->port = port;
+    state->thermal_on = thermal_on;
+    state->fridge = fridge;
+    state->qmeter_on = qmeter_on;
+    state->qmeter = qmeter;
+    state->modulation = modulation;
+    state->kalman_on = kalman_on;
+    state->filter = filter;
+    state->pol_rate_fresh = pol_rate_fresh;
+}
+
+void restore_state(const struct sim_state *state) {
+    sim_time = state->sim_time;
+    freq = state->freq;
+    field = state->field;
+    temp = state->temp;
+    dose_rate = state->dose_rate;
+    last_anneal_dose = state->last_anneal_dose;
+    dose = state->dose;
+    n_anneals = state->n_anneals;
+    pol = state->pol;
+    species = state->species;
+    pol_rate = state->pol_rate;
+    direction = state->direction;
+    serial_on = state->serial_on;
+    port = state->port;
+    thermal_on = state->thermal_on;
+    fridge = state->fridge;
+    qmeter_on = state->qmeter_on;
+    qmeter = state->qmeter;
+    modulation = state->modulation;
+    model_version++;
+    kalman_on = state->kalman_on;
+    filter = state->filter;
+    pol_rate_fresh = state->pol_rate_fresh;
+}
+
+void take_snapshot() {
+    if (record_mode != REC_RECORDING || sim_time < next_snapshot) return;
+
+    struct sim_state state;
+    memset(&state, 0, sizeof(state)); // No stray padding bytes in the recording
+    save_state(&state);
+    record_snapshot(sim_time, &state, sizeof(state));
+    next_snapshot = sim_time + snapshot_interval;
+}
+
+char *read_run_text(char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return "";
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    rewind(f);
+    char *text = len >= 0 ? arena_alloc(&run_arena, len + 1) : NULL;
+    if (!text) {
+        fclose(f);
+        return NULL;
+    }
+    len = fread(text, 1, len, f);
+    text[len] = '\0';
+    fclose(f);
+    return text;
+}
+
+int dump_ensemble(int argc, char **argv) {
+    if (argc < 1 || argc > 2) {
+        puts("Usage: sim -e file.ens [run]");
+        return 1;
+    }
+    struct ens_file ens;
+    if (ens_open(&ens, argv[0])) {
+        printf("Could not open ensemble file: %s\n", argv[0]);
+        return 1;
+    }
+
+    char meta[BUF_LEN];
+    if (argc == 1) {
+        // Directory of runs
+        puts("Run  Rows      File");
+        for (size_t i = 0; i < ens.n_runs; i++) {
+            ens_read_meta(&ens, i, meta, BUF_LEN);
+            strip_newline(meta);
+            printf("%-4lu %-9lu %s\n", (unsigned long)i, (unsigned long)ens.runs[i].n_rows,
+                   strncmp(meta, "file=", 5) ? meta : meta + 5);
+        }
+    } else {
+        // One run, in the same format as a .dat file
+        size_t run = strtoul(argv[1], NULL, 10);
+        if (run >= ens.n_runs) {
+            printf("No run %lu (file has %lu runs)\n", (unsigned long)run, (unsigned long)ens.n_runs);
+            ens_close(&ens);
+            return 1;
+        }
+        size_t n_rows = ens.runs[run].n_rows;
+        double *cols[N_COLUMNS];
+        for (int c = 0; c < N_COLUMNS; c++) {
+            cols[c] = arena_alloc(&run_arena, n_rows * sizeof(double));
+            if (!cols[c]) {
+                puts("Out of memory for the run's columns");
+                ens_close(&ens);
                 return 1;
             }
-            port = port_temp;
-            printf("Serial on for port %d\n", port);
-            serial_on = true;
-        } else if (!strcmp(script_getarg(0), "off")) {
-            puts("Serial off");
-            serial_on = false;
+            ens_read_column(&ens, run, c, cols[c]);
+        }
+        for (size_t i = 0; i < n_rows; i++) {
+            printf("%6lf %6lf %6lf %6lf %6lf %6lf ", cols[0][i], cols[1][i], cols[2][i], cols[3][i], cols[4][i], cols[5][i]);
+            if (isnan(cols[6][i])) {
+                puts("N/A   ");
+            } else {
+                printf("%6d\n", (int)cols[6][i]);
+            }
+        }
+    }
+    ens_close(&ens);
+    return 0;
+}
+
+int summarize_files(int argc, char **argv) {
+    int n_threads = 0;
+    if (argc >= 2 && !strcmp(argv[0], "-j")) {
+        n_threads = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 1) {
+        puts("Usage: sim -p [-j threads] file...");
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < argc; i++) {
+        struct table t;
+        if (parse_file(&t, argv[i], n_threads)) {
+            printf("Could not parse file: %s\n", argv[i]);
+            failed = 1;
+            continue;
+        }
+        printf("%s: %lu rows, %d columns, %lu bad fields (%.3lf s, %.1lf MB/s)\n", argv[i],
+               (unsigned long)t.n_rows, t.n_cols, (unsigned long)t.n_bad, t.seconds,
+               t.seconds > 0 ? t.len / t.seconds / 1e6 : 0.0);
+        for (int c = 0; c < t.n_cols; c++) {
+            if (t.type[c] == PARSE_TEXT) {
+                printf("  %-16s text    first: %s\n", t.name[c], t.n_rows ? t.text[c][0] : "");
+                continue;
+            }
+            double min = INFINITY, max = -INFINITY, sum = 0.0;
+            size_t n = 0;
+            for (size_t r = 0; r < t.n_rows; r++) {
+                double v = t.num[c][r];
+                if (isnan(v)) continue;
+                min = v < min ? v : min;
+                max = v > max ? v : max;
+                sum += v;
+                n++;
+            }
+            printf("  %-16s number  min %lf  mean %lf  max %lf  (%lu missing)\n", t.name[c],
+                   min, n ? sum / n : NAN, max, (unsigned long)(t.n_rows - n));
+        }
+        parse_free(&t);
+    }
+    return failed;
+}
+
+int compare_files(int argc, char **argv) {
+    int n_threads = 0;
+    double offset = 0.0;
+    while (argc >= 2 && (!strcmp(argv[0], "-j") || !strcmp(argv[0], "-t"))) {
+        if (argv[0][1] == 'j') {
+            n_threads = atoi(argv[1]);
         } else {
-            puts("Invalid serial instruction, continuing with serial off");
-            serial_on = false;
+            offset = atof(argv[1]);
         }
-        // Get next command ready
-        read = script_readline();
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 2) {
+        puts("Usage: sim -c [-j threads] [-t offset] file.dat|file.ens log...");
+        return 1;
     }
 
-    sim_init();
-    puts("Initialized simulation");
-    
-    // Command loop
-    do {
-        // Command loop
-        if (script_cmdequ("freq")) {
-            double tmp;
-            sscanf(script_getarg(0), "%6lf", &tmp);
-            set_freq(tmp);
-            printf("Set frequency: %6lf\n", freq);
-        } else if (script_cmdequ("time")) {
-            double until;
-            sscanf(script_getarg(0), "%6lf", &until);
-            printf("Running until time: %6lf\n", until);
-            run_until(until);
-        }
-    } while ((read = script_readline()));
-    
-    // Close files and exit
-    fclose(output);
-    script_fclose();
-    puts("Simulation finished successfully (press enter to exit)");
-    getchar();
-    
+    struct comparison *results = arena_alloc(&run_arena, (argc - 1) * sizeof(struct comparison));
+    if (!results) {
+        puts("Out of memory for the comparisons");
+        return 1;
+    }
+    compare_logs(argv[0], argc - 1, argv + 1, offset, n_threads, results);
+    int failed = 0;
+    for (int i = 0; i < argc - 1; i++) {
+        struct comparison *c = &results[i];
+        if (c->failed) {
+            printf("%s: could not compare (needs time and pol columns)\n", argv[i + 1]);
+            failed = 1;
+            continue;
+        }
+        printf("%s: %lu points (%lu outside the simulation)\n", argv[i + 1],
+               (unsigned long)c->all.n, (unsigned long)c->n_outside);
+        puts("  Segment  Points     Mean       RMS        Max");
+        for (int s = 0; s <= N_SEGMENTS; s++) {
+            struct residuals *r = s < N_SEGMENTS ? &c->seg[s] : &c->all;
+            if (!r->n) continue;
+            printf("  %-8s %-10lu %-10lf %-10lf %-10lf\n", s < N_SEGMENTS ? compare_segment_name(s) : "all",
+                   (unsigned long)r->n, r->mean, residuals_rms(r), r->max_abs);
+        }
+    }
+    return failed;
+}
+
+int diff_side(int side, FILE *rows) {
+    diff_commands = diff_params[side];
+    diff_output = rows;
+    return run_file(diff_run_file);
+}
+
+int run_diff(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        puts("Usage: sim -d file.run \"commands\" [\"commands\"]");
+        return 1;
+    }
+    diff_run_file = argv[0];
+    diff_params[0] = argv[1];
+    diff_params[1] = argc == 3 ? argv[2] : "";
+
+    char *diff_filename = arena_alloc(&run_arena, strlen(diff_run_file) + 12);
+    if (!diff_filename) {
+        puts("Out of memory for the output file name");
+        return 1;
+    }
+    strcpy(diff_filename, diff_run_file);
+    strip_extension(diff_filename);
+    strcat(diff_filename, ".diff.dat");
+    FILE *diffs = fopen(diff_filename, "w");
+    if (!diffs) {
+        printf("Could not open output file: %s\n", diff_filename);
+        return 1;
+    }
+
+    FILE *rows[2];
+    struct diff_stats stats;
+    diff_init(&stats, N_COLUMNS, 2, DIVERGED_POL);
+    if (!diff_start(diff_side, rows)) {
+        // Time, both polarizations, then the differences of pol, steady state and lambda
+        double a[N_COLUMNS], b[N_COLUMNS];
+        while (diff_read(rows, N_COLUMNS, a, b)) {
+            diff_add(&stats, a, b);
+            fprintf(diffs, "%6lf %6lf %6lf %6lf %6lf %6lf\n", a[0], a[2], b[2], b[2] - a[2], b[3] - a[3], b[4] - a[4]);
+        }
+    }
+    fclose(diffs);
+    int failed[2];
+    if (diff_finish(rows, failed)) {
+        for (int i = 0; i < 2; i++) {
+            if (failed[i]) printf("Side %d (\"%s\") failed\n", i + 1, diff_params[i]);
+        }
+        return 1;
+    }
+
+    printf("Compared %lu steps of %s (\"%s\" vs \"%s\")\n", (unsigned long)stats.n_rows, diff_run_file,
+           diff_params[0], diff_params[1]);
+    puts("Column         Max diff     At time      RMS diff     Final diff");
+    for (int c = 1; c < N_COLUMNS - 1; c++) {
+        printf("%-14s %-12lf %-12lf %-12lf %-12lf\n", COLUMN_NAMES[c], stats.max_abs[c], stats.max_at[c],
+               stats.n_rows ? sqrt(stats.sum_sq[c] / stats.n_rows) : 0.0, stats.last[c]);
+    }
+    if (isnan(stats.diverged_at)) {
+        printf("Never diverged (pol difference over %lf%%)\n", DIVERGED_POL);
+    } else {
+        printf("Diverged (pol difference over %lf%%) at time %6lf\n", DIVERGED_POL, stats.diverged_at);
+    }
+    printf("Step by step differences written to %s\n", diff_filename);
+    return 0;
+}
+
+int print_compressed(int argc, char **argv) {
+    if (argc != 1) {
+        puts("Usage: sim -Z file.gor");
+        return 1;
+    }
+    struct gorilla_reader reader;
+    if (gorilla_read_open(&reader, argv[0])) {
+        printf("Could not open compressed output: %s\n", argv[0]);
+        return 1;
+    }
+    // Same text as a .dat file (the direction column is N/A without serial)
+    double row[GORILLA_MAX_COLS];
+    int got;
+    while ((got = gorilla_next(&reader, row)) > 0) {
+        for (int c = 0; c < reader.n_cols; c++) {
+            if (strcmp(reader.names[c], "direction")) {
+                printf(c ? " %6lf" : "%6lf", row[c]);
+            } else if (isnan(row[c])) {
+                printf(" N/A   ");
+            } else {
+                printf(" %6d", (int)row[c]);
+            }
+        }
+        putchar('\n');
+    }
+    gorilla_read_close(&reader);
+    if (got < 0) {
+        printf("Damaged compressed output: %s\n", argv[0]);
+        return 1;
+    }
     return 0;
 }
 
 void sim_init() {
+    if (!species.n) {
+        species_init(&species);
+    }
+    thermal_init(&fridge, temp);
     // Make sure the necessary calculations are done at least once
     set_freq(freq);
     update_pol();
@@ -253,13 +1485,34 @@ void run_until(double until) {
     while (sim_time <= until) {
         time(&curr_time); // The current time (don't update until this is at least DELAY seconds after old_time)
         
-        if (serial_on) {
+        if (serial_on && record_mode == REC_REPLAYING) {
+            // Ticks happen where they did in the recording, without waiting
+            process_command();
+            if (!replay_tick()) {
+                log_msg(LOG_INFO, "End of recording");
+                break;
+            }
+            double tick_start = kalman_clock();
+            update_sim();
+            if (kalman_on) {
+                track_box(tick_start);
+            }
+            if (sim_time >= seek_time) {
+                log_msg(LOG_INFO, "Simulation time: %6lf", sim_time);
+            }
+        } else if (serial_on) {
             // Process any input commands
             process_command();
             // Wait until DELAY seconds before updating
             if (difftime(curr_time, old_time) >= DELAY) {
+                double tick_start = kalman_clock();
+                record_tick();
                 update_sim();
-                printf("Simulation time: %6lf\n", sim_time);
+                if (kalman_on) {
+                    track_box(tick_start);
+                }
+                take_snapshot();
+                log_msg(LOG_INFO, "Simulation time: %6lf", sim_time);
                 // Reset "timer"
                 old_time = curr_time;
             }
@@ -267,14 +1520,30 @@ void run_until(double until) {
             // Output old data first
             output_data();
             update_sim();
+            take_snapshot();
         }
     }
+    // Show everything before carrying on with the run file
+    log_flush();
 }
 
 void update_sim() {
     double old_pol = pol;
+    if (thermal_on || dose_rate > 0) {
+        // The temperature and dose move the steady state; advance them, then
+        // re-anchor the model so the polarization relaxes from where it is
+        if (thermal_on) {
+            thermal_step(&fridge, BEAM_HEAT*dose_rate, DELTA_T);
+            temp = fridge.t_sample;
+        }
+        dose += dose_rate * DELTA_T;
+        update_a_param();
+    }
     sim_time += DELTA_T;
     update_pol();
+    if (qmeter_on) {
+        nmr_sweep(&qmeter, pol);
+    }
     
     // Update pol_rate if there is no serial to calculate it for us
     if (!serial_on) {
@@ -282,56 +1551,85 @@ void update_sim() {
     }
 }
 
-double optimal_freq_pos() {
-    //"The positive polarization frequencies are more linear as they drift lower, from about 140.20 to near 140.13 GHZ in SANE."
-    //From Polarized Sources, Targets and Polarimetry...Proceedings of the 13th Inernational Workshop. Pg. 151
-    
-    //Update 10/14/2015:
-    //here is a curve for optimal POS freq based on SANE data 
-    double A_pos = 140.1; //This is the "steady state" frequency
-    double C_pos = 0.045; //This is the range; add this to A to get the initial frequency
-    double k_pos = 0.38;  //This determines the decay rate
-    
-    return (A_pos + C_pos*exp(-k_pos*dose))*field/5.0;
+void model(double *ss, double *lambda) {
+    // Without beam or thermal dynamics the inputs stay put for many steps,
+    // so the last result is kept (the modulated model is expensive)
+    static double last_ss[MAX_SPECIES], last_lambda[MAX_SPECIES];
+    static double last_freq = NAN, last_dose, last_field, last_temp;
+    static unsigned last_version;
+    if (freq != last_freq || dose != last_dose || field != last_field || temp != last_temp
+        || model_version != last_version) {
+        if (modulation.amplitude > 0.0) {
+            species_model_fm(&species, &modulation, freq, dose, field, temp, last_ss, last_lambda);
+        } else {
+            species_model(&species, freq, dose, field, temp, last_ss, last_lambda);
+        }
+        last_freq = freq;
+        last_dose = dose;
+        last_field = field;
+        last_temp = temp;
+        last_version = model_version;
+    }
+    memcpy(ss, last_ss, sizeof(last_ss));
+    memcpy(lambda, last_lambda, sizeof(last_lambda));
 }
 
-double optimal_freq_neg() {
-    //"In the case of DNP for negative polarization...a fast increase in the optimum microwave frequency which quickly slows, 
-    //creating an exponential curve which...goes from 140.4 to around 150.53 GHz at the end of the anneal cycle (close to 4 Pe/cm^2)"
-    //--same source as "optimal_freq_pos()"
-    
-    //Update 10/14/2015:
-    //here is a curve for optimal NEG freq based on SANE data 
-    double A_neg = 140.535; //This is the "steady state" frequency
-    double C_neg = 0.065; //The range, subtract this from A to get the initial frequency
-    double k_neg = 3.8; //This determines growth rate
-    
-    return (A_neg - C_neg*exp(-k_neg*dose))*field/5.0;
+void track_box(double tick_start) {
+    double lambda = get_lambda(), ss = get_steady_state();
+    kalman_predict(&filter, lambda, ss, DELTA_T);
+    if (pol_rate_fresh) {
+        // Time used so far this tick, recorded so a replay makes the same choice
+        int64_t used = record_clock((int64_t)((kalman_clock() - tick_start)*1e9));
+        kalman_update(&filter, lambda, ss, pol_rate, used*1e-9);
+        pol_rate_fresh = false;
+    }
+    // Carry on from the estimate
+    pol = filter.x[0];
+    update_a_param();
+    kalman_latency(&filter, kalman_clock() - tick_start);
+}
+
+void print_latency() {
+    printf("Ticks: %lu, mean %6lf us, max %6lf us, %lu over budget, %lu updates skipped\n", filter.n_ticks,
+           filter.n_ticks ? filter.latency_sum / filter.n_ticks * 1e6 : 0.0, filter.latency_max * 1e6,
+           filter.n_over, filter.n_skipped);
 }
 
 double get_steady_state() {
-    // This is not based strictly on the data; a better model will be provided once better data is obtained
-    double pos_diff = freq - optimal_freq_pos();
-    double neg_diff = freq - optimal_freq_neg();
-    // Modelled as pair of Gaussians with standard deviation 0.1 GHz
-    return exp(-pos_diff*pos_diff/0.02) - exp(-neg_diff*neg_diff/0.02);
+    double ss[MAX_SPECIES], lambda[MAX_SPECIES];
+    model(ss, lambda);
+    return ss[0];
 }
 
 double get_lambda() {
-    // This is not based strictly on the data; a better model will be provided once better data is obtained
-    // Modelled as a Gaussian with mean as the average of optimal frequencies and standard deviation 0.15
-    double m = 0.5*(optimal_freq_pos() + optimal_freq_neg());
-    double dev = freq - m;
-    return 0.005*exp(-dev*dev/0.045);
+    double ss[MAX_SPECIES], lambda[MAX_SPECIES];
+    model(ss, lambda);
+    return lambda[0];
 }
 
 void update_a_param() {
-    a_param = exp(get_lambda() * sim_time) * (get_steady_state() - pol);
+    double ss[MAX_SPECIES], lambda[MAX_SPECIES];
+    species.pol[0] = pol;
+    model(ss, lambda);
+    species_update_a(&species, sim_time, ss, lambda);
 }
 
 void update_pol() {
     // TODO: Check that this model works
-    pol = get_steady_state() - a_param * exp(-get_lambda() * sim_time);
+    double ss[MAX_SPECIES], lambda[MAX_SPECIES];
+    model(ss, lambda);
+    species_update_pol(&species, sim_time, ss, lambda);
+    pol = species.pol[0];
+}
+
+void set_temp(double temperature) {
+    fridge.t_base = temperature;
+    if (!thermal_on) {
+        // No dynamics, the sample is simply at the base temperature
+        fridge.t_sample = fridge.t_bath = temperature;
+        temp = temperature;
+    }
+    update_a_param();
 }
 
 void set_freq(double frequency) {
@@ -340,13 +1638,87 @@ void set_freq(double frequency) {
 }
 
 void output_data() {
-    if (serial_on) {
-        puts("Writing to file");
-        fprintf(output, "%6lf %6lf %6lf %6lf %6lf %6lf %6d\n", sim_time, freq, 100*pol, 100*get_steady_state(), get_lambda(), 100*pol_rate, direction);
+    if (sim_time < seek_time) {
+        return; // Still fast-forwarding to the seek time
+    }
+    output_started = true;
+    // The species 0 columns, as every binary output and the telemetry have them
+    // (there is no motor direction with serial off)
+    double row[N_COLUMNS] = {sim_time, freq, 100*pol, 100*get_steady_state(), get_lambda(), 100*pol_rate,
+                             serial_on ? direction : NAN};
+    if (telemetry_on) {
+        telemetry_row(row);
+    }
+    if (diff_output) {
+        fwrite(row, sizeof(row), 1, diff_output);
+        return;
+    } else if (arrow_output && !ensemble_path) {
+        if (serial_on) {
+            log_msg(LOG_DEBUG, "Writing to file");
+        }
+        if (arrow_add(&arrow, row)) {
+            log_msg(LOG_ERROR, "Could not write to the output file");
+        }
+        return; // Only the species 0 columns, as in an ensemble
+    } else if (compress_output && !ensemble_path) {
+        if (serial_on) {
+            log_msg(LOG_DEBUG, "Writing to file");
+        }
+        if (gorilla_add(&compressed, row)) {
+            log_msg(LOG_ERROR, "Could not write to the output file");
+        }
+        return; // Only the species 0 columns, as in an ensemble
+    } else if (ensemble_path) {
+        if (serial_on) {
+            log_msg(LOG_DEBUG, "Writing to ensemble");
+        }
+        if (ens_run_add_row(&ensemble_run, row)) {
+            puts("Out of memory for ensemble rows");
+        }
+        return; // The ensemble only has the species 0 columns
+    } else if (serial_on) {
+        log_msg(LOG_DEBUG, "Writing to file");
+        char line[ROW_LEN];
+        int len = snprintf(line, ROW_LEN, "%6lf %6lf %6lf %6lf %6lf %6lf %6d", row[0], row[1], row[2], row[3], row[4], row[5], direction);
+        // Polarization of any extra species
+        for (int i = 1; i < species.n; i++) {
+            len += snprintf(line + len, ROW_LEN - len, " %6lf", 100*species.pol[i]);
+        }
+        // Estimated rate drift (the polarization column is already the estimate)
+        if (kalman_on) {
+            len += snprintf(line + len, ROW_LEN - len, " %6lf", 100*filter.x[1]);
+        }
+        len += snprintf(line + len, ROW_LEN - len, "\n");
+        if (rotating) {
+            if (rotate_write(&rotation, sim_time, line, len)) {
+                log_msg(LOG_ERROR, "Could not write to the output segment");
+            }
+        } else if (output) {
+            fwrite(line, 1, len, output);
+        }
+        return;
     } else {
         // There will be no direction to output if we have serial off, so just put N/A in the column
-        fprintf(output, "%6lf %6lf %6lf %6lf %6lf %6lf N/A   \n", sim_time, freq, 100*pol, 100*get_steady_state(), get_lambda(), 100*pol_rate);
+        if (!format_tried) {
+            formatting = !format_start(output, 6, " N/A   ", 0);
+            format_tried = true;
+        }
+        if (formatting) {
+            double values[6 + MAX_SPECIES];
+            memcpy(values, row, 6*sizeof(double));
+            for (int i = 1; i < species.n; i++) {
+                values[5 + i] = 100*species.pol[i];
+            }
+            format_row(values, species.n - 1);
+            return;
+        }
+        fprintf(output, "%6lf %6lf %6lf %6lf %6lf %6lf N/A   ", row[0], row[1], row[2], row[3], row[4], row[5]);
     }
+    // Polarization of any extra species
+    for (int i = 1; i < species.n; i++) {
+        fprintf(output, " %6lf", 100*species.pol[i]);
+    }
+    fputc('\n', output);
 }
 
 void serial_init() {
@@ -361,19 +1733,19 @@ void process_command() {
     while ((control = serial_rx_byte(port))) {
         switch((int)control) {
         case 0x11:
-            puts("Reading frequency");
+            log_msg(LOG_DEBUG, "Reading frequency");
             rx_freq();
             break;
         case 0x33:
-            puts("Confirmation requested");
+            log_msg(LOG_DEBUG, "Confirmation requested");
             tx_confirmation();
             break;
         case 0x77:
-            puts("Writing event number");
+            log_msg(LOG_DEBUG, "Writing event number");
             tx_event_num();
             break;
         case 0x88:
-            puts("Reading motor direction");
+            log_msg(LOG_DEBUG, "Reading motor direction");
             rx_direction();
 	        // The direction is the last bit of data to be
 	        // sent by the box, so we know we have a complete
@@ -381,31 +1753,40 @@ void process_command() {
             output_data();
             break;
         case 0xBB:
-            puts("Reading polarization rate");
+            log_msg(LOG_DEBUG, "Reading polarization rate");
             rx_pol_rate();
             break;
         case 0xEE:
             rx_string();
             break;
+        case 0xDD:
+            log_msg(LOG_DEBUG, "Writing NMR sweep");
+            tx_sweep();
+            break;
         case 0xFF:
-            puts("Writing polarization");
+            log_msg(LOG_DEBUG, "Writing polarization");
             tx_pol();
             break;
         default:
-            printf("Received unknown control byte: %hhX\n", control);
+            log_msg(LOG_WARN, "Received unknown control byte: %hhX", control);
         }
     }
 }
 
 void rx_string() {
-    printf("Message: \"");
+    char message[BUF_LEN];
+    size_t len = 0;
     
     uint8_t c;
     while ((c = serial_rx_byte_wait(port)) != 0x0) {
-        putchar(c);
+        // Anything past the buffer is still read, just not shown
+        if (len < BUF_LEN - 1) {
+            message[len++] = c;
+        }
     }
+    message[len] = '\0';
     
-    printf("\"\n");
+    log_msg(LOG_INFO, "Message: \"%s\"", message);
 }
 
 void rx_freq() {
@@ -419,15 +1800,14 @@ void tx_confirmation() {
 }
 
 void tx_event_num() {
-    time_t event_time;
-    time(&event_time);
-    uint32_t event_num = (uint32_t)event_time;
+    uint32_t event_num = (uint32_t)record_clock(time(NULL));
     
     serial_tx_int32(port, event_num);
 }
 
 void rx_pol_rate() {
     pol_rate = (double)serial_rx_float(port);
+    pol_rate_fresh = true;
 }
 
 void rx_direction() {
@@ -435,5 +1815,18 @@ void rx_direction() {
 }
 
 void tx_pol() {
-    serial_tx_float(port, (float)pol);
+    // With the Q-meter on, the box gets what the NMR measurement would give
+    // (the model's polarization until the first sweep)
+    bool measured = qmeter_on && !isnan(qmeter.measured_pol);
+    serial_tx_float(port, (float)(measured ? qmeter.measured_pol : pol));
+}
+
+void tx_sweep() {
+    // Number of points, then each point (0 points if the Q-meter is off or hasn't swept yet)
+    int n = qmeter_on && !isnan(qmeter.measured_pol) ? qmeter.n_points : 0;
+    const double *signal = nmr_signal();
+    serial_tx_int32(port, n);
+    for (int i = 0; i < n; i++) {
+        serial_tx_float(port, (float)signal[i]);
+    }
 }
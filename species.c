@@ -0,0 +1,239 @@
+#include "species.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && !defined(FM_NO_SIMD)
+// Let the compiler use SIMD registers for whole groups of modulation points
+#define FM_SIMD
+typedef double vdouble __attribute__((vector_size(FM_LANES * sizeof(double))));
+typedef uint64_t vuint __attribute__((vector_size(FM_LANES * sizeof(uint64_t))));
+typedef int64_t vmask __attribute__((vector_size(FM_LANES * sizeof(int64_t))));
+// Lane-wise "mask ? a : b" (C has no vector conditional operator)
+#define SELECT(mask, a, b) ((vdouble)(((vmask)(a) & (mask)) | ((vmask)(b) & ~(mask))))
+#endif
+
+// Unaligned loads/stores of a whole group of lanes
+#define LOAD(v, p) memcpy(&(v), (p), sizeof(v))
+#define STORE(p, v) memcpy((p), &(v), sizeof(v))
+
+static const double PI = 3.14159265358979323846;
+
+struct species_params {
+    const char *name;
+    double pos_a, pos_c, pos_k;
+    double neg_a, neg_c, neg_k;
+    double ss_max, ss_width;
+    double lambda_max, lambda_width;
+};
+
+static const struct species_params KNOWN_SPECIES[] = {
+    // Protons (NH3)
+    //"The positive polarization frequencies are more linear as they drift lower, from about 140.20 to near 140.13 GHZ in SANE."
+    //"In the case of DNP for negative polarization...a fast increase in the optimum microwave frequency which quickly slows,
+    //creating an exponential curve which...goes from 140.4 to around 150.53 GHz at the end of the anneal cycle (close to 4 Pe/cm^2)"
+    //From Polarized Sources, Targets and Polarimetry...Proceedings of the 13th Inernational Workshop. Pg. 151
+    //Update 10/14/2015: curves for the optimal POS and NEG freq based on SANE data
+    //The steady state and rate are not based strictly on the data; a better model will be provided once better data is obtained
+    //(pair of Gaussians with standard deviation 0.1 GHz, and a Gaussian with standard deviation 0.15 around the middle)
+    {"proton", 140.1, 0.045, 0.38, 140.535, 0.065, 3.8, 1.0, 0.02, 0.005, 0.045},
+    // Deuterons (ND3): the optimal frequencies sit closer to the ESR line, and
+    // polarization is lower and slower (rough values, to be tuned against data)
+    {"deuteron", 140.19, 0.02, 0.38, 140.42, 0.02, 3.8, 0.5, 0.01, 0.0008, 0.045},
+};
+
+static void set_params(struct species_set *s, int i, const struct species_params *p) {
+    strncpy(s->name[i], p->name, SPECIES_NAME_LEN - 1);
+    s->name[i][SPECIES_NAME_LEN - 1] = '\0';
+    s->pos_a[i] = p->pos_a;
+    s->pos_c[i] = p->pos_c;
+    s->pos_k[i] = p->pos_k;
+    s->neg_a[i] = p->neg_a;
+    s->neg_c[i] = p->neg_c;
+    s->neg_k[i] = p->neg_k;
+    s->ss_max[i] = p->ss_max;
+    s->ss_width[i] = p->ss_width;
+    s->lambda_max[i] = p->lambda_max;
+    s->lambda_width[i] = p->lambda_width;
+    s->pol[i] = 0.0;
+    s->a_param[i] = 1.0;
+}
+
+void species_init(struct species_set *s) {
+    // Fill every slot, so the unused ones compute harmless values
+    for (int i = 0; i < MAX_SPECIES; i++) {
+        set_params(s, i, &KNOWN_SPECIES[0]);
+    }
+    s->n = 1;
+}
+
+int species_add(struct species_set *s, const char *name) {
+    if (s->n == MAX_SPECIES) return 1;
+    for (size_t k = 0; k < sizeof(KNOWN_SPECIES)/sizeof(KNOWN_SPECIES[0]); k++) {
+        if (!strcmp(KNOWN_SPECIES[k].name, name)) {
+            set_params(s, s->n++, &KNOWN_SPECIES[k]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void species_model(const struct species_set *s, double freq, double dose, double field, double temp,
+                   double *ss, double *lambda) {
+    // Falls off with temperature: 95% at 1K and 72% at 1.62K (from "Polarization
+    // Studies with Radiation Doped Ammonia at 5T and 1K*", (1990), fig. 14)
+    const double temp_factor = exp(-0.4471*(temp - 1));
+    for (int i = 0; i < MAX_SPECIES; i++) {
+        double f_pos = (s->pos_a[i] + s->pos_c[i]*exp(-s->pos_k[i]*dose))*field/5.0;
+        double f_neg = (s->neg_a[i] - s->neg_c[i]*exp(-s->neg_k[i]*dose))*field/5.0;
+        double pos_diff = freq - f_pos;
+        double neg_diff = freq - f_neg;
+        double p = s->ss_max[i]*(exp(-pos_diff*pos_diff/s->ss_width[i]) - exp(-neg_diff*neg_diff/s->ss_width[i]));
+        p *= temp_factor;
+        ss[i] = p > 1.0 ? 1.0 : (p < -1.0 ? -1.0 : p);
+
+        double dev = freq - 0.5*(f_pos + f_neg);
+        lambda[i] = s->lambda_max[i]*exp(-dev*dev/s->lambda_width[i]);
+    }
+}
+
+int fm_set(struct fm *fm, double amplitude, const char *shape, int n_points) {
+    if (n_points <= 0) n_points = FM_DEFAULT_POINTS;
+    n_points = (n_points + FM_LANES - 1) / FM_LANES * FM_LANES;
+    if (n_points > FM_MAX_POINTS) n_points = FM_MAX_POINTS;
+
+    // Midpoints of the cycle: for a periodic waveform this is the most
+    // accurate rule there is (spectral convergence for a sine)
+    for (int k = 0; k < n_points; k++) {
+        double phase = (k + 0.5) / n_points;
+        double w;
+        if (!strcmp(shape, "sine")) {
+            w = sin(2*PI*phase);
+        } else if (!strcmp(shape, "triangle")) {
+            w = 1.0 - 4.0*fabs(phase - 0.5);
+        } else if (!strcmp(shape, "square")) {
+            w = phase < 0.5 ? 1.0 : -1.0;
+        } else {
+            return 1;
+        }
+        fm->offset[k] = amplitude * w;
+    }
+    fm->amplitude = amplitude;
+    fm->n_points = n_points;
+    return 0;
+}
+
+#ifdef FM_SIMD
+// exp() of a whole group of lanes, in place: 2^k * exp(r) with |r| <= ln(2)/2
+// and a degree 11 Taylor polynomial for exp(r) (within 1e-14 of libm)
+static void vexp(double *lanes) {
+    const double LOG2E = 1.4426950408889634;
+    const double LN2_HI = 6.93147180369123816490e-01;
+    const double LN2_LO = 1.90821492927058770002e-10;
+    const double SHIFT = 0x1.8p52; // Adding this rounds to an integer, left in the low bits
+    const vdouble LO = (vdouble){0} - 708.0; // Broadcasts, so they fill however many lanes there are
+    const vdouble HI = (vdouble){0} + 709.0;
+    vdouble x;
+    LOAD(x, lanes);
+    x = SELECT(x < LO, LO, x);
+    x = SELECT(x > HI, HI, x);
+    vdouble kd = x*LOG2E + SHIFT;
+    vuint ki = (vuint)kd;
+    kd -= SHIFT;
+    vdouble r = x - kd*LN2_HI - kd*LN2_LO;
+    vdouble p = r*(1.0/39916800) + 1.0/3628800;
+    p = p*r + 1.0/362880;
+    p = p*r + 1.0/40320;
+    p = p*r + 1.0/5040;
+    p = p*r + 1.0/720;
+    p = p*r + 1.0/120;
+    p = p*r + 1.0/24;
+    p = p*r + 1.0/6;
+    p = p*r + 1.0/2;
+    p = p*r + 1.0;
+    p = p*r + 1.0;
+    p *= (vdouble)((ki + 1023) << 52);
+    STORE(lanes, p);
+}
+#endif
+
+void species_model_fm(const struct species_set *s, const struct fm *fm, double freq, double dose, double field, double temp,
+                      double *ss, double *lambda) {
+    const double temp_factor = exp(-0.4471*(temp - 1));
+    // Only the species in use (the unused slots just stay put)
+    for (int i = s->n; i < MAX_SPECIES; i++) {
+        ss[i] = lambda[i] = 0.0;
+    }
+    for (int i = 0; i < s->n; i++) {
+        double f_pos = (s->pos_a[i] + s->pos_c[i]*exp(-s->pos_k[i]*dose))*field/5.0;
+        double f_neg = (s->neg_a[i] - s->neg_c[i]*exp(-s->neg_k[i]*dose))*field/5.0;
+        double f_mid = 0.5*(f_pos + f_neg);
+        double ss_scale = s->ss_max[i]*temp_factor;
+        double ss_inv = -1.0/s->ss_width[i];
+        double lambda_inv = -1.0/s->lambda_width[i];
+
+        // Fast modulation: every point pumps at its own rate towards its own
+        // steady state, so the rate averages and the steady state is
+        // weighted by the rate
+        double sum_lambda = 0.0, sum_weighted = 0.0;
+#ifdef FM_SIMD
+        const vdouble ONE = (vdouble){0} + 1.0;
+        vdouble acc_lambda = {0}, acc_weighted = {0};
+        for (int k = 0; k < fm->n_points; k += FM_LANES) {
+            vdouble f;
+            LOAD(f, fm->offset + k);
+            f += freq;
+            vdouble pos_diff = f - f_pos, neg_diff = f - f_neg, dev = f - f_mid;
+            double g_pos[FM_LANES], g_neg[FM_LANES], g_mid[FM_LANES];
+            pos_diff *= pos_diff*ss_inv;
+            neg_diff *= neg_diff*ss_inv;
+            dev *= dev*lambda_inv;
+            STORE(g_pos, pos_diff);
+            STORE(g_neg, neg_diff);
+            STORE(g_mid, dev);
+            vexp(g_pos);
+            vexp(g_neg);
+            vexp(g_mid);
+            vdouble p, n, l;
+            LOAD(p, g_pos);
+            LOAD(n, g_neg);
+            LOAD(l, g_mid);
+            p = ss_scale*(p - n);
+            p = SELECT(p > ONE, ONE, p);
+            p = SELECT(p < -ONE, -ONE, p);
+            l *= s->lambda_max[i];
+            acc_lambda += l;
+            acc_weighted += l*p;
+        }
+        for (int j = 0; j < FM_LANES; j++) {
+            sum_lambda += acc_lambda[j];
+            sum_weighted += acc_weighted[j];
+        }
+#else
+        for (int k = 0; k < fm->n_points; k++) {
+            double f = freq + fm->offset[k];
+            double pos_diff = f - f_pos, neg_diff = f - f_neg, dev = f - f_mid;
+            double p = ss_scale*(exp(pos_diff*pos_diff*ss_inv) - exp(neg_diff*neg_diff*ss_inv));
+            p = p > 1.0 ? 1.0 : (p < -1.0 ? -1.0 : p);
+            double l = s->lambda_max[i]*exp(dev*dev*lambda_inv);
+            sum_lambda += l;
+            sum_weighted += l*p;
+        }
+#endif
+        lambda[i] = sum_lambda / fm->n_points;
+        ss[i] = sum_lambda > 0.0 ? sum_weighted / sum_lambda : 0.0;
+    }
+}
+
+void species_update_a(struct species_set *s, double t, const double *ss, const double *lambda) {
+    for (int i = 0; i < MAX_SPECIES; i++) {
+        s->a_param[i] = exp(lambda[i] * t) * (ss[i] - s->pol[i]);
+    }
+}
+
+void species_update_pol(struct species_set *s, double t, const double *ss, const double *lambda) {
+    for (int i = 0; i < MAX_SPECIES; i++) {
+        s->pol[i] = ss[i] - s->a_param[i] * exp(-lambda[i] * t);
+    }
+}
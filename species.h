@@ -0,0 +1,51 @@
+// species.h --- Nuclear species polarized together in the same material
+//
+// Every species has its own optimal-frequency curves, steady state and rate,
+// and follows the same model as the main simulation:
+// P = P_infinity - A*exp(-lambda*t)
+// The parameters are stored one array per quantity (indexed by species), so
+// the per-step loops run across all species at once.
+#ifndef _SPECIES_H
+#define _SPECIES_H
+
+#define MAX_SPECIES 4 // Loops always cover this many (unused slots are harmless)
+#define SPECIES_NAME_LEN 16
+#define FM_LANES 4 // Modulation points evaluated together
+#define FM_MAX_POINTS 64
+#define FM_DEFAULT_POINTS 32
+
+struct species_set {
+    int n; // Number of species in use (species 0 is the one the box sees)
+    char name[MAX_SPECIES][SPECIES_NAME_LEN];
+    // Optimal frequencies (GHz at 5T): A + C*exp(-k*dose) for positive
+    // polarization, A - C*exp(-k*dose) for negative
+    double pos_a[MAX_SPECIES], pos_c[MAX_SPECIES], pos_k[MAX_SPECIES];
+    double neg_a[MAX_SPECIES], neg_c[MAX_SPECIES], neg_k[MAX_SPECIES];
+    // Steady state: ss_max*(exp(-(f - f_pos)^2/ss_width) - exp(-(f - f_neg)^2/ss_width))
+    double ss_max[MAX_SPECIES], ss_width[MAX_SPECIES];
+    // Rate: lambda_max*exp(-(f - (f_pos + f_neg)/2)^2/lambda_width)
+    double lambda_max[MAX_SPECIES], lambda_width[MAX_SPECIES];
+    // State
+    double pol[MAX_SPECIES];
+    double a_param[MAX_SPECIES];
+};
+
+// Microwave frequency modulation: the frequency sweeps freq + offset[k]
+// over one cycle, much faster than the polarization can follow
+struct fm {
+    double amplitude; // GHz (0 == no modulation)
+    int n_points; // Quadrature points per cycle (a multiple of FM_LANES)
+    double offset[FM_MAX_POINTS];
+};
+
+void species_init(struct species_set *s); // starts with protons only
+int species_add(struct species_set *s, const char *name); // adds a known species ("proton", "deuteron"), returns 0 on success
+void species_model(const struct species_set *s, double freq, double dose, double field, double temp,
+                   double *ss, double *lambda); // steady state and rate of every species
+int fm_set(struct fm *fm, double amplitude, const char *shape, int n_points); // "sine", "triangle" or "square", returns 0 on success
+void species_model_fm(const struct species_set *s, const struct fm *fm, double freq, double dose, double field, double temp,
+                      double *ss, double *lambda); // steady state and rate averaged over the modulation cycle
+void species_update_a(struct species_set *s, double t, const double *ss, const double *lambda); // re-anchors A to the current polarizations
+void species_update_pol(struct species_set *s, double t, const double *ss, const double *lambda); // polarizations at time t
+
+#endif
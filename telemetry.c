@@ -0,0 +1,515 @@
+#define _POSIX_C_SOURCE 200809L // For sockets, poll, clock_gettime and pthreads
+
+#include "telemetry.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) || defined(__FreeBSD__)
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define RING_ROWS 4096 // Rows waiting for the next batch
+#define MAX_CLIENTS 64
+#define REQUEST_LEN 2048 // Longest handshake request (and client frame) taken
+#define CLIENT_BUF_LEN (1 << 20) // Bytes queued for a client before it misses batches
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define CLOSE_WAIT 0.5 // Seconds spent getting the last rows out when stopping
+
+struct client {
+    int fd;
+    bool upgraded; // Handshake done
+    bool closing; // Close after sending what is queued
+    char in[REQUEST_LEN];
+    size_t in_len;
+    char *out;
+    size_t out_start, out_len; // Queued bytes: out[out_start .. out_start + out_len)
+};
+
+// Rows from the simulation (single producer, the server thread consumes)
+static double ring[RING_ROWS][TELEMETRY_MAX_VALUES];
+static unsigned long ring_head, ring_tail;
+static unsigned long ring_dropped;
+
+static int n_values;
+static char names[TELEMETRY_MAX_VALUES][TELEMETRY_NAME_LEN];
+static int decimation, skip;
+static double interval; // Seconds between batches
+static int listen_fd = -1;
+static struct client clients[MAX_CLIENTS];
+static int n_clients;
+static char *batch; // JSON of the batch being sent
+static size_t batch_cap;
+static pthread_t server;
+static bool running = false, stopping;
+
+static uint32_t rol(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1(const unsigned char *data, size_t len, unsigned char digest[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    // The message, 0x80, zeros and the length in bits fill whole blocks
+    size_t total = ((len + 8) / 64 + 1) * 64;
+    for (size_t off = 0; off < total; off += 64) {
+        unsigned char block[64];
+        for (int i = 0; i < 64; i++) {
+            size_t k = off + i;
+            block[i] = k < len ? data[k] : k == len ? 0x80 : 0;
+        }
+        if (off + 64 == total) {
+            uint64_t bits = (uint64_t)len * 8;
+            for (int i = 0; i < 8; i++) block[63 - i] = bits >> (8*i);
+        }
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[4*i] << 24 | block[4*i + 1] << 16 | block[4*i + 2] << 8 | block[4*i + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 20; i++) {
+        digest[i] = h[i / 4] >> (24 - 8*(i % 4));
+    }
+}
+
+static void base64(const unsigned char *data, size_t len, char *out) {
+    static const char DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0) | (i + 2 < len ? data[i + 2] : 0);
+        *out++ = DIGITS[v >> 18];
+        *out++ = DIGITS[(v >> 12) & 63];
+        *out++ = i + 1 < len ? DIGITS[(v >> 6) & 63] : '=';
+        *out++ = i + 2 < len ? DIGITS[v & 63] : '=';
+    }
+    *out = '\0';
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void drop_client(int i) {
+    close(clients[i].fd);
+    free(clients[i].out);
+    clients[i] = clients[--n_clients];
+}
+
+// Queues bytes for a client, returns 1 if there's no room (nothing is queued then)
+static int queue(struct client *c, const void *data, size_t len) {
+    if (c->out_len + len > CLIENT_BUF_LEN) return 1;
+    if (c->out_start + c->out_len + len > CLIENT_BUF_LEN) {
+        memmove(c->out, c->out + c->out_start, c->out_len);
+        c->out_start = 0;
+    }
+    memcpy(c->out + c->out_start + c->out_len, data, len);
+    c->out_len += len;
+    return 0;
+}
+
+// Queues a whole frame (server frames are not masked), returns 1 if there's no room
+static int queue_frame(struct client *c, int opcode, const char *payload, size_t len) {
+    unsigned char header[10];
+    size_t n = 2;
+    header[0] = 0x80 | opcode;
+    if (len < 126) {
+        header[1] = len;
+    } else if (len < 65536) {
+        header[1] = 126;
+        header[2] = len >> 8;
+        header[3] = len;
+        n = 4;
+    } else {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++) header[2 + i] = (uint64_t)len >> (56 - 8*i);
+        n = 10;
+    }
+    if (c->out_len + n + len > CLIENT_BUF_LEN) return 1;
+    queue(c, header, n);
+    queue(c, payload, len);
+    return 0;
+}
+
+static void client_frames(struct client *c);
+
+static void handshake(struct client *c) {
+    char *end = strstr(c->in, "\r\n\r\n");
+    if (!end) {
+        if (c->in_len == REQUEST_LEN - 1) c->closing = true; // Too long for a handshake
+        return;
+    }
+    // Sec-WebSocket-Key, whatever the case of the header name
+    const char *key = NULL;
+    size_t key_len = 0;
+    for (char *line = c->in; line < end; line = strstr(line, "\r\n") + 2) {
+        if (!strncasecmp(line, "Sec-WebSocket-Key:", 18)) {
+            key = line + 18;
+            while (*key == ' ') key++;
+            key_len = strcspn(key, " \r");
+        }
+    }
+    if (!key || key_len > 64) {
+        const char *reply = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        queue(c, reply, strlen(reply));
+        c->closing = true;
+        return;
+    }
+    char accept_in[128], accept[32], reply[256];
+    memcpy(accept_in, key, key_len);
+    strcpy(accept_in + key_len, WS_GUID);
+    unsigned char digest[20];
+    sha1((unsigned char *)accept_in, strlen(accept_in), digest);
+    base64(digest, 20, accept);
+    snprintf(reply, sizeof(reply), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+             "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    queue(c, reply, strlen(reply));
+    c->upgraded = true;
+    // Frames may have come in the same packet as the request
+    size_t used = end + 4 - c->in;
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    c->in[c->in_len] = '\0';
+
+    // The columns, once
+    char hello[TELEMETRY_MAX_VALUES * (TELEMETRY_NAME_LEN + 4) + 16];
+    size_t len = snprintf(hello, sizeof(hello), "{\"columns\":[");
+    for (int i = 0; i < n_values; i++) {
+        len += snprintf(hello + len, sizeof(hello) - len, i ? ",\"%s\"" : "\"%s\"", names[i]);
+    }
+    len += snprintf(hello + len, sizeof(hello) - len, "]}");
+    queue_frame(c, 1, hello, len);
+    client_frames(c);
+}
+
+// Handles the frames a client sent (only close and ping matter)
+static void client_frames(struct client *c) {
+    unsigned char *in = (unsigned char *)c->in;
+    while (c->in_len >= 2) {
+        int opcode = in[0] & 0x0F;
+        bool masked = in[1] & 0x80;
+        uint64_t len = in[1] & 0x7F;
+        size_t n = 2;
+        if (len == 126) {
+            if (c->in_len < 4) return;
+            len = in[2] << 8 | in[3];
+            n = 4;
+        } else if (len == 127) {
+            c->closing = true; // Nothing a dashboard sends is that long
+            return;
+        }
+        size_t frame = n + (masked ? 4 : 0) + len;
+        if (frame > REQUEST_LEN - 1) {
+            c->closing = true;
+            return;
+        }
+        if (c->in_len < frame) return;
+        char payload[REQUEST_LEN];
+        for (uint64_t i = 0; i < len; i++) {
+            payload[i] = in[n + (masked ? 4 : 0) + i] ^ (masked ? in[n + i % 4] : 0);
+        }
+        if (opcode == 8) {
+            queue_frame(c, 8, payload, len < 2 ? len : 2);
+            c->closing = true;
+        } else if (opcode == 9) {
+            queue_frame(c, 10, payload, len);
+        }
+        memmove(c->in, c->in + frame, c->in_len - frame);
+        c->in_len -= frame;
+    }
+}
+
+// Makes room for more than n bytes in the batch, returns 1 if out of memory
+static int batch_reserve(size_t len, size_t n) {
+    if (batch_cap - len > n) return 0;
+    size_t cap = 2*batch_cap + n + 1;
+    char *grown = realloc(batch, cap);
+    if (!grown) return 1;
+    batch = grown;
+    batch_cap = cap;
+    return 0;
+}
+
+static void batch_text(size_t *len, const char *text) {
+    size_t n = strlen(text);
+    if (batch_reserve(*len, n)) return;
+    memcpy(batch + *len, text, n);
+    *len += n;
+}
+
+static void batch_number(size_t *len, double value) {
+    if (batch_reserve(*len, 32)) return;
+    // JSON has no NaN or infinity
+    *len += isfinite(value) ? snprintf(batch + *len, 32, "%.9g", value) : snprintf(batch + *len, 32, "null");
+}
+
+// Sends the rows waiting in the ring to every client
+static void send_batch() {
+    unsigned long head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    unsigned long dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_ACQ_REL);
+    if (head == ring_tail && !dropped) return;
+    size_t len = 0;
+    batch_text(&len, "{\"rows\":[");
+    for (unsigned long r = ring_tail; r != head; r++) {
+        const double *v = ring[r % RING_ROWS];
+        batch_text(&len, r == ring_tail ? "[" : ",[");
+        for (int i = 0; i < n_values; i++) {
+            if (i) batch_text(&len, ",");
+            batch_number(&len, v[i]);
+        }
+        batch_text(&len, "]");
+    }
+    __atomic_store_n(&ring_tail, head, __ATOMIC_RELEASE);
+    char end[48];
+    snprintf(end, sizeof(end), "],\"dropped\":%lu}", dropped);
+    batch_text(&len, end);
+    for (int i = 0; i < n_clients; i++) {
+        if (clients[i].upgraded && !clients[i].closing) {
+            queue_frame(&clients[i], 1, batch, len); // A slow client misses this one
+        }
+    }
+}
+
+// Sends as much of a client's queue as the socket takes, returns 1 if the connection is lost
+static int send_queued(struct client *c) {
+    if (!c->out_len) return 0;
+    ssize_t n = send(c->fd, c->out + c->out_start, c->out_len, MSG_NOSIGNAL);
+    if (n > 0) {
+        c->out_start += n;
+        c->out_len -= n;
+    } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return 1;
+    }
+    return 0;
+}
+
+static void accept_clients() {
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        if (n_clients == MAX_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        struct client *c = &clients[n_clients];
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->out = malloc(CLIENT_BUF_LEN);
+        if (!c->out) {
+            close(fd);
+            continue;
+        }
+        n_clients++;
+    }
+}
+
+static void *serve(void *arg) {
+    (void)arg;
+    double next_batch = now() + interval;
+    struct pollfd fds[MAX_CLIENTS + 1];
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < n_clients; i++) {
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = POLLIN | (clients[i].out_len ? POLLOUT : 0);
+        }
+        int wait_ms = (next_batch - now()) * 1000;
+        if (wait_ms < 0) wait_ms = 0;
+        if (wait_ms > 100) wait_ms = 100; // Notice stopping soon enough
+        int ready = poll(fds, n_clients + 1, wait_ms);
+
+        if (ready > 0) {
+            // Back to front, so dropping a client doesn't skip another
+            for (int i = n_clients - 1; i >= 0; i--) {
+                struct client *c = &clients[i];
+                short revents = fds[i + 1].revents;
+                bool lost = revents & (POLLERR | POLLHUP);
+                if (revents & POLLIN) {
+                    ssize_t n = recv(c->fd, c->in + c->in_len, REQUEST_LEN - 1 - c->in_len, 0);
+                    if (n > 0) {
+                        c->in_len += n;
+                        c->in[c->in_len] = '\0';
+                        if (c->upgraded) {
+                            client_frames(c);
+                        } else {
+                            handshake(c);
+                        }
+                    } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                        lost = true;
+                    }
+                }
+                if (!lost && send_queued(c)) {
+                    lost = true;
+                }
+                if (lost || (c->closing && !c->out_len)) {
+                    drop_client(i);
+                }
+            }
+            if (fds[0].revents & POLLIN) {
+                accept_clients();
+            }
+        }
+        if (now() >= next_batch) {
+            send_batch();
+            next_batch += interval;
+            if (next_batch < now()) next_batch = now() + interval;
+        }
+    }
+
+    // The rows still in the ring, then "going away" (1001), and a moment to send them
+    send_batch();
+    const char going_away[2] = {0x03, (char)0xE9};
+    for (int i = 0; i < n_clients; i++) {
+        if (clients[i].upgraded && !clients[i].closing) {
+            queue_frame(&clients[i], 8, going_away, 2);
+        }
+        clients[i].closing = true;
+    }
+    double give_up = now() + CLOSE_WAIT;
+    while (n_clients > 0 && now() < give_up) {
+        for (int i = 0; i < n_clients; i++) {
+            fds[i].fd = clients[i].fd;
+            fds[i].events = POLLOUT;
+        }
+        if (poll(fds, n_clients, (give_up - now()) * 1000 + 1) < 0) break;
+        for (int i = n_clients - 1; i >= 0; i--) {
+            bool lost = fds[i].revents & (POLLERR | POLLHUP);
+            if (lost || send_queued(&clients[i]) || !clients[i].out_len) {
+                drop_client(i);
+            }
+        }
+    }
+    for (int i = n_clients - 1; i >= 0; i--) {
+        drop_client(i);
+    }
+    return NULL;
+}
+
+int telemetry_start(int port, double rate, int every, int n, const char (*column_names)[TELEMETRY_NAME_LEN]) {
+    if (running) telemetry_stop();
+    if (n < 1 || n > TELEMETRY_MAX_VALUES || rate <= 0) return 1;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) return 1;
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Only this machine
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(listen_fd, 16)) {
+        close(listen_fd);
+        return 1;
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    n_values = n;
+    for (int i = 0; i < n; i++) {
+        snprintf(names[i], TELEMETRY_NAME_LEN, "%s", column_names[i]);
+    }
+    decimation = every > 0 ? every : 1;
+    skip = 0;
+    interval = 1.0 / rate;
+    ring_head = ring_tail = ring_dropped = 0;
+    n_clients = 0;
+    stopping = false;
+    if (pthread_create(&server, NULL, serve, NULL)) {
+        close(listen_fd);
+        return 1;
+    }
+    running = true;
+    return 0;
+}
+
+void telemetry_row(const double *values) {
+    if (!running) return;
+    if (skip > 0) {
+        skip--;
+        return;
+    }
+    skip = decimation - 1;
+    unsigned long head = ring_head;
+    if (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == RING_ROWS) {
+        __atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memcpy(ring[head % RING_ROWS], values, n_values * sizeof(double));
+    __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void telemetry_stop() {
+    if (!running) return;
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_join(server, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    free(batch);
+    batch = NULL;
+    batch_cap = 0;
+    running = false;
+}
+
+#else
+
+int telemetry_start(int port, double rate, int every, int n, const char (*column_names)[TELEMETRY_NAME_LEN]) {
+    (void)port; (void)rate; (void)every; (void)n; (void)column_names;
+    return 1;
+}
+
+void telemetry_row(const double *values) {
+    (void)values;
+}
+
+void telemetry_stop() {
+}
+
+#endif
@@ -0,0 +1,20 @@
+// telemetry.h --- Live output rows for dashboards, over WebSocket on localhost
+//
+// A background thread serves ws://127.0.0.1:<port>/ to any number of
+// clients. Every client first gets {"columns":[...]}, then, rate times a
+// second, {"rows":[[...],...],"dropped":n} with the rows output since the
+// last batch (every decimation-th row). The simulation only copies a row
+// into a ring, so it never waits for the network: rows that don't fit in
+// the ring are dropped (and counted), and a client too slow to take a
+// batch simply misses it.
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#define TELEMETRY_MAX_VALUES 8 // Values per row
+#define TELEMETRY_NAME_LEN 16 // Length of a column name (including the terminator)
+
+int telemetry_start(int port, double rate, int decimation, int n_values, const char (*names)[TELEMETRY_NAME_LEN]); // returns 0 on success
+void telemetry_row(const double *values); // offers a row (kept if it is a decimation-th one and there's room)
+void telemetry_stop(); // sends the rows still waiting and a close frame, then closes every connection and stops the thread
+
+#endif
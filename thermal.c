@@ -0,0 +1,69 @@
+#include "thermal.h"
+
+#include <math.h>
+
+// Model constants (a ~1 K evaporation fridge with a small target)
+const double C_SAMPLE = 0.01; // Heat capacity of the sample (J/K)
+const double C_BATH = 500.0; // Heat capacity of the helium bath (J/K)
+const double G_SAMPLE_BATH = 5.0; // Thermal conductance between sample and bath (W/K)
+const double COOL_POWER = 1.0; // Cooling power scale at 1 K (W)
+const double VAPOR_EXP = 7.2; // Helium vapor pressure goes as exp(-VAPOR_EXP / T)
+
+// Cooling power of the fridge, zero at the base temperature
+static double cooling(const struct thermal *th, double t_bath) {
+    return COOL_POWER * (exp(VAPOR_EXP * (1.0 - 1.0/t_bath)) - exp(VAPOR_EXP * (1.0 - 1.0/th->t_base)));
+}
+
+static double cooling_deriv(double t_bath) {
+    return COOL_POWER * exp(VAPOR_EXP * (1.0 - 1.0/t_bath)) * VAPOR_EXP / (t_bath*t_bath);
+}
+
+// Time derivatives of (t_sample, t_bath)
+static void derivs(const struct thermal *th, double p_beam, const double *y, double *dy) {
+    double flow = G_SAMPLE_BATH * (y[0] - y[1]);
+    dy[0] = (p_beam + th->p_mw - flow) / C_SAMPLE;
+    dy[1] = (flow - cooling(th, y[1])) / C_BATH;
+}
+
+// Solves (I - g*J) x = b for the 2x2 system
+static void solve(const double m[2][2], const double *b, double *x) {
+    double det = m[0][0]*m[1][1] - m[0][1]*m[1][0];
+    x[0] = (b[0]*m[1][1] - m[0][1]*b[1]) / det;
+    x[1] = (m[0][0]*b[1] - b[0]*m[1][0]) / det;
+}
+
+void thermal_init(struct thermal *th, double t_base) {
+    th->t_sample = th->t_bath = th->t_base = t_base;
+    th->p_mw = 0.0;
+}
+
+void thermal_step(struct thermal *th, double p_beam, double h) {
+    const double gamma = 1.0 + 1.0/sqrt(2.0);
+    double y[2] = {th->t_sample, th->t_bath};
+
+    // Jacobian of derivs at y
+    double jac[2][2] = {
+        {-G_SAMPLE_BATH / C_SAMPLE, G_SAMPLE_BATH / C_SAMPLE},
+        {G_SAMPLE_BATH / C_BATH, (-G_SAMPLE_BATH - cooling_deriv(y[1])) / C_BATH}
+    };
+    double m[2][2];
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            m[i][j] = (i == j) - gamma*h*jac[i][j];
+        }
+    }
+
+    // ROS2: (I - gamma*h*J) k1 = f(y), (I - gamma*h*J) k2 = f(y + h*k1) - 2*k1
+    double f[2], k1[2], k2[2], y1[2];
+    derivs(th, p_beam, y, f);
+    solve(m, f, k1);
+    y1[0] = y[0] + h*k1[0];
+    y1[1] = y[1] + h*k1[1];
+    derivs(th, p_beam, y1, f);
+    f[0] -= 2*k1[0];
+    f[1] -= 2*k1[1];
+    solve(m, f, k2);
+
+    th->t_sample = y[0] + h*(1.5*k1[0] + 0.5*k2[0]);
+    th->t_bath = y[1] + h*(1.5*k1[1] + 0.5*k2[1]);
+}
@@ -0,0 +1,21 @@
+// thermal.h --- Fridge temperature model (target sample coupled to the helium bath)
+//
+// C_s dT_s/dt = P_beam + P_mw - G (T_s - T_b)
+// C_b dT_b/dt = G (T_s - T_b) - P_cool(T_b)
+// The sample follows the bath within a fraction of a second while the bath
+// takes minutes, so the system is stiff; it is integrated with a two-stage
+// Rosenbrock method (ROS2), which stays stable at the full simulation step.
+#ifndef _THERMAL_H
+#define _THERMAL_H
+
+struct thermal {
+    double t_sample; // Sample temperature (K)
+    double t_bath; // Helium bath temperature (K)
+    double t_base; // Bath temperature with no heat load (K)
+    double p_mw; // Microwave power reaching the sample (W)
+};
+
+void thermal_init(struct thermal *th, double t_base); // starts in equilibrium at t_base
+void thermal_step(struct thermal *th, double p_beam, double h); // advances by h seconds with a beam heat load p_beam (W)
+
+#endif
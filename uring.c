@@ -0,0 +1,470 @@
+#define _GNU_SOURCE // For fopencookie
+
+#include "uring.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool uring_on = false;
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 64
+#define SQ_IDLE_MS 100 // The polling thread sleeps after this long without work
+#define OUT_BUFS 4
+#define OUT_BUF_LEN 65536
+#define SERIAL_BUF_LEN 512
+#define TX_BUFS 2
+
+// Registered buffers: the output buffers, then the serial ones
+#define RX_INDEX OUT_BUFS
+#define TX_INDEX (OUT_BUFS + 1)
+#define N_BUFFERS (OUT_BUFS + 1 + TX_BUFS)
+
+// What a completion belongs to (user_data is the operation | buffer)
+#define OP_MASK 0xF00
+#define OP_OUT 0x100
+#define OP_RX 0x200
+#define OP_TX 0x300
+
+struct out_file {
+    int fd;
+    off_t offset; // Where the next write goes
+    int error; // First failed write (an errno value)
+};
+
+static pid_t ring_pid = 0; // A forked child sets up its own ring
+static int ring_fd = -1;
+static bool sqpoll = false;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *sq_flags;
+static struct io_uring_sqe *sqes;
+static unsigned to_submit = 0; // Queued but not yet submitted (without the polling thread)
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static unsigned char out_bufs[OUT_BUFS][OUT_BUF_LEN];
+static bool out_busy[OUT_BUFS];
+static size_t out_len[OUT_BUFS];
+static struct out_file *out_owner[OUT_BUFS];
+
+static int serial_fd = -1;
+static unsigned char rx_buf[SERIAL_BUF_LEN];
+static unsigned char rx_queue[SERIAL_BUF_LEN]; // Received bytes not read yet
+static int rx_len = 0, rx_pos = 0;
+static bool rx_pending = false; // A read is in flight
+static unsigned char tx_bufs[TX_BUFS][SERIAL_BUF_LEN];
+static bool tx_busy[TX_BUFS];
+static int tx_sent[TX_BUFS];
+static int tx_cur = 0, tx_len = 0; // Buffer being filled
+
+static int enter(unsigned submit, unsigned wait, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, submit, wait, flags, NULL, 0);
+}
+
+static int setup() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = SQ_IDLE_MS;
+    ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (ring_fd < 0) {
+        // No polling thread allowed, submit with a system call instead
+        memset(&p, 0, sizeof(p));
+        ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    }
+    if (ring_fd < 0) return 1;
+    sqpoll = p.flags & IORING_SETUP_SQPOLL;
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_len > sq_len) sq_len = cq_len;
+    unsigned char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    unsigned char *cq = single ? sq : mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring_fd);
+        return 1;
+    }
+    sq_head = (unsigned *)(sq + p.sq_off.head);
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    sq_flags = (unsigned *)(sq + p.sq_off.flags);
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Pin the buffers once, so no operation has to map its buffer
+    struct iovec iov[N_BUFFERS];
+    for (int i = 0; i < OUT_BUFS; i++) {
+        iov[i].iov_base = out_bufs[i];
+        iov[i].iov_len = OUT_BUF_LEN;
+    }
+    iov[RX_INDEX].iov_base = rx_buf;
+    iov[RX_INDEX].iov_len = SERIAL_BUF_LEN;
+    for (int i = 0; i < TX_BUFS; i++) {
+        iov[TX_INDEX + i].iov_base = tx_bufs[i];
+        iov[TX_INDEX + i].iov_len = SERIAL_BUF_LEN;
+    }
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov, N_BUFFERS)) {
+        close(ring_fd);
+        return 1;
+    }
+    memset(out_busy, 0, sizeof(out_busy));
+    memset(tx_busy, 0, sizeof(tx_busy));
+    to_submit = 0;
+    ring_pid = getpid();
+    return 0;
+}
+
+// The ring of this process (set up again after a fork)
+static int ensure_ring() {
+    return ring_pid == getpid() ? 0 : setup();
+}
+
+// A cleared entry at the tail of the submission queue
+static struct io_uring_sqe *get_sqe() {
+    unsigned tail = *sq_tail;
+    struct io_uring_sqe *sqe = &sqes[tail & *sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Makes the entry from get_sqe visible to the kernel
+static void push_sqe() {
+    unsigned tail = *sq_tail;
+    sq_array[tail & *sq_mask] = tail & *sq_mask;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+}
+
+static void submit() {
+    if (sqpoll) {
+        // The polling thread picks up new entries by itself unless it fell asleep
+        if (__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP) {
+            enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+    } else if (to_submit) {
+        enter(to_submit, 0, 0);
+    }
+    to_submit = 0;
+}
+
+// Blocks until at least one operation completes
+static void wait_cqe() {
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    if (sqpoll && (__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)) {
+        flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+    if (enter(sqpoll ? 0 : to_submit, 1, flags) < 0 && errno != EINTR) {
+        perror("io_uring_enter");
+    }
+    to_submit = 0;
+}
+
+static void complete(uint64_t data, int res) {
+    int i = data & ~OP_MASK;
+    switch (data & OP_MASK) {
+    case OP_OUT:
+        out_busy[i] = false;
+        if (res < 0 && !out_owner[i]->error) {
+            out_owner[i]->error = -res;
+        } else if (res >= 0 && (size_t)res < out_len[i] && !out_owner[i]->error) {
+            out_owner[i]->error = EIO; // Short write (disk full)
+        }
+        break;
+    case OP_RX:
+        rx_pending = false;
+        if (res > 0) {
+            memcpy(rx_queue, rx_buf, res);
+            rx_len = res;
+            rx_pos = 0;
+        }
+        break;
+    case OP_TX:
+        tx_busy[i] = false;
+        if (res >= 0 && res < tx_sent[i]) {
+            // The rest of a short write goes out the plain way
+            if (write(serial_fd, tx_bufs[i] + res, tx_sent[i] - res) < 0) perror("Serial write");
+        } else if (res < 0) {
+            errno = -res;
+            perror("Serial write");
+        }
+        break;
+    }
+}
+
+// Handles every finished operation (no system call)
+static void reap() {
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        complete(cqe->user_data, cqe->res);
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+int uring_start() {
+    if (setup()) return 1;
+    uring_on = true;
+    return 0;
+}
+
+void uring_stop() {
+    if (!uring_on || ring_pid != getpid()) return;
+    uring_serial_flush();
+    for (;;) {
+        reap();
+        bool busy = false;
+        for (int i = 0; i < OUT_BUFS; i++) busy |= out_busy[i];
+        for (int i = 0; i < TX_BUFS; i++) busy |= tx_busy[i];
+        if (!busy) break;
+        wait_cqe();
+    }
+    // Closing the ring cancels the read still waiting for the box
+    close(ring_fd);
+    ring_pid = 0;
+    serial_fd = -1;
+    uring_on = false;
+}
+
+// Output files
+
+static ssize_t out_write(void *cookie, const char *buf, size_t size) {
+    struct out_file *f = cookie;
+    size_t done = 0;
+    while (done < size && !f->error) {
+        // A free buffer (waiting for one if they are all being written)
+        int b = -1;
+        for (;;) {
+            reap();
+            for (int i = 0; i < OUT_BUFS && b < 0; i++) {
+                if (!out_busy[i]) b = i;
+            }
+            if (b >= 0) break;
+            wait_cqe();
+        }
+        size_t n = size - done < OUT_BUF_LEN ? size - done : OUT_BUF_LEN;
+        memcpy(out_bufs[b], buf + done, n);
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = f->fd;
+        sqe->off = f->offset;
+        sqe->addr = (uintptr_t)out_bufs[b];
+        sqe->len = n;
+        sqe->buf_index = b;
+        sqe->user_data = OP_OUT | b;
+        push_sqe();
+        out_busy[b] = true;
+        out_len[b] = n;
+        out_owner[b] = f;
+        f->offset += n;
+        done += n;
+        // Submitted with the next batch (or right away by the polling thread)
+        if (sqpoll) submit();
+    }
+    if (f->error) {
+        errno = f->error;
+        return -1;
+    }
+    return done;
+}
+
+static int out_close(void *cookie) {
+    struct out_file *f = cookie;
+    submit();
+    for (;;) {
+        reap();
+        bool busy = false;
+        for (int i = 0; i < OUT_BUFS; i++) {
+            busy |= out_busy[i] && out_owner[i] == f;
+        }
+        if (!busy) break;
+        wait_cqe();
+    }
+    int error = f->error;
+    close(f->fd);
+    free(f);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+FILE *uring_fopen(const char *path, const char *mode) {
+    if (ensure_ring()) return NULL;
+    struct out_file *f = malloc(sizeof(*f));
+    if (!f) return NULL;
+    bool append = mode[0] == 'a';
+    f->fd = open(path, O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+    f->error = 0;
+    if (f->fd < 0) {
+        free(f);
+        return NULL;
+    }
+    // Writes go to explicit offsets, so appending starts them at the end
+    f->offset = append ? lseek(f->fd, 0, SEEK_END) : 0;
+    if (f->offset < 0) {
+        close(f->fd);
+        free(f);
+        return NULL;
+    }
+    cookie_io_functions_t io = {NULL, out_write, NULL, out_close};
+    FILE *stream = fopencookie(f, "w", io);
+    if (!stream) {
+        close(f->fd);
+        free(f);
+    }
+    return stream;
+}
+
+// Serial port
+
+static void arm_read() {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = serial_fd;
+    sqe->off = (uint64_t)-1; // Not seekable
+    sqe->addr = (uintptr_t)rx_buf;
+    sqe->len = SERIAL_BUF_LEN;
+    sqe->buf_index = RX_INDEX;
+    sqe->user_data = OP_RX;
+    push_sqe();
+    submit();
+    rx_pending = true;
+}
+
+int uring_serial_attach(int fd) {
+    if (ensure_ring()) return 1;
+    // Reads wait in the ring for at least a byte rather than failing with
+    // EAGAIN or coming back empty
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK)) return 1;
+    struct termios settings;
+    if (tcgetattr(fd, &settings)) return 1;
+    settings.c_cc[VMIN] = 1;
+    settings.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &settings)) return 1;
+    serial_fd = fd;
+    rx_len = rx_pos = 0;
+    tx_len = 0;
+    arm_read();
+    return 0;
+}
+
+bool uring_serial_attached() {
+    return serial_fd >= 0 && ring_pid == getpid();
+}
+
+int uring_serial_read(unsigned char *buf, int size, bool wait) {
+    // The box only answers what it was sent
+    uring_serial_flush();
+    for (;;) {
+        reap();
+        if (rx_pos < rx_len) {
+            int n = rx_len - rx_pos < size ? rx_len - rx_pos : size;
+            memcpy(buf, rx_queue + rx_pos, n);
+            rx_pos += n;
+            if (rx_pos == rx_len && !rx_pending) {
+                arm_read();
+            }
+            return n;
+        }
+        if (!rx_pending) {
+            arm_read();
+        }
+        if (!wait) return 0;
+        wait_cqe();
+    }
+}
+
+void uring_serial_write(const unsigned char *buf, int size) {
+    while (size > 0) {
+        int n = SERIAL_BUF_LEN - tx_len < size ? SERIAL_BUF_LEN - tx_len : size;
+        memcpy(tx_bufs[tx_cur] + tx_len, buf, n);
+        tx_len += n;
+        buf += n;
+        size -= n;
+        if (tx_len == SERIAL_BUF_LEN) {
+            uring_serial_flush();
+        }
+    }
+}
+
+void uring_serial_flush() {
+    if (!tx_len || serial_fd < 0) return;
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = serial_fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uintptr_t)tx_bufs[tx_cur];
+    sqe->len = tx_len;
+    sqe->buf_index = TX_INDEX + tx_cur;
+    sqe->user_data = OP_TX | tx_cur;
+    push_sqe();
+    submit();
+    tx_busy[tx_cur] = true;
+    tx_sent[tx_cur] = tx_len;
+
+    // Fill the other buffer next (once it has been sent)
+    tx_cur = (tx_cur + 1) % TX_BUFS;
+    tx_len = 0;
+    while (tx_busy[tx_cur]) {
+        reap();
+        if (tx_busy[tx_cur]) wait_cqe();
+    }
+}
+
+#else
+
+int uring_start() {
+    puts("io_uring is not supported on this platform");
+    return 1;
+}
+
+void uring_stop() {
+}
+
+FILE *uring_fopen(const char *path, const char *mode) {
+    (void)path; (void)mode;
+    return NULL;
+}
+
+int uring_serial_attach(int fd) {
+    (void)fd;
+    return 1;
+}
+
+bool uring_serial_attached() {
+    return false;
+}
+
+int uring_serial_read(unsigned char *buf, int size, bool wait) {
+    (void)buf; (void)size; (void)wait;
+    return 0;
+}
+
+void uring_serial_write(const unsigned char *buf, int size) {
+    (void)buf; (void)size;
+}
+
+void uring_serial_flush() {
+}
+
+#endif
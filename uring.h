@@ -0,0 +1,27 @@
+// uring.h --- io_uring backend for serial and output file I/O (Linux)
+//
+// With 'sim -U', output files and the serial port go through an io_uring
+// instead of a write() per stdio flush and a read()/write() per byte.
+// Output writes are copied into registered buffers and submitted in
+// batches; the serial port always has a read in flight, and replies are
+// collected and sent as one write when the box is next polled. With a
+// submission-queue polling thread (when the kernel allows one) the
+// protocol loop makes no system calls at all while data keeps flowing.
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+extern bool uring_on; // Whether the backend is in use
+
+int uring_start(); // sets up the backend, returns 0 on success (1 if io_uring is not available)
+void uring_stop(); // waits for every write to finish and shuts the backend down
+FILE *uring_fopen(const char *path, const char *mode); // opens a file for writing ("w") or appending ("a") through the ring (NULL on failure)
+int uring_serial_attach(int fd); // reads and writes this serial port through the ring, returns 0 on success
+bool uring_serial_attached(); // whether a serial port is attached
+int uring_serial_read(unsigned char *buf, int size, bool wait); // bytes received (0 if none and not waiting)
+void uring_serial_write(const unsigned char *buf, int size); // queues bytes for the box
+void uring_serial_flush(); // sends the queued bytes
+
+#endif